@@ -6,6 +6,21 @@
 struct anchor_t {
 	int beg;			// where should read begin?
 	int offset;			// where this anchor begin on read?
+	int seed;			// index of its seed
+};
+
+/*
+ * Exact diagonal groups of one transcript whose begins are at most a band
+ * apart, as left by small indels. main is the largest group, the one
+ * covering more of the read on ties
+ */
+struct anchor_chain_t {
+	int beg;			// anchors [beg, end) of seed_t.ancs
+	int end;
+	int main;
+	int n_main;
+	int n_diag;			// number of groups
+	int support;			// number of distinct seeds
 };
 
 struct seed_t {
@@ -19,6 +34,10 @@ struct seed_t {
 	int **hits;
 	int n_seed;
 	int m_seed;
+
+	struct anchor_chain_t *chains;	// by decreasing support
+	int n_chain;
+	int m_chain;
 };
 
 struct align_stat_t {
@@ -33,6 +52,7 @@ struct align_stat_t {
 struct align_t {
 	int pos;			// Position on concatenate sequences
 	int score;			// Align score
+	int indel;			// from banded extension
 };
 
 struct raw_alg_t {
@@ -19,6 +19,21 @@
 
 RS_IMPL(recycle, struct recycle_alg_t, 32, 8, recycle_less_than, recycle_get_block)
 
+/* begin biased to sort negative ones first */
+#define anchor_key(p) ((uint64_t)((uint32_t)(p).beg ^ UINT32_C(0x80000000)) << 32 | \
+		       (uint32_t)(p).seed)
+#define anchor_get_block(p, s, mask) (anchor_key(p) >> (s) & (mask))
+#define anchor_less_than(x, y) (anchor_key(x) < anchor_key(y))
+
+RS_IMPL(anchor, struct anchor_t, 64, 8, anchor_less_than, anchor_get_block)
+
+/* decreasing support, ties by position */
+#define chain_key(p) ((uint64_t)(UINT16_MAX - (p).support) << 32 | (uint32_t)(p).beg)
+#define chain_get_block(p, s, mask) (chain_key(p) >> (s) & (mask))
+#define chain_less_than(x, y) (chain_key(x) < chain_key(y))
+
+RS_IMPL(chain, struct anchor_chain_t, 48, 8, chain_less_than, chain_get_block)
+
 static struct gene_info_t genes;
 static struct transcript_info_t trans;
 
@@ -122,35 +137,81 @@ void find_cons_seeds(struct read_t *read, struct seed_t *ret)
 	get_cons_seed(read, ret, step);
 }
 
+/* Anchors of all hits, sorted by begin then by seed */
 void merge_seed(struct seed_t *s)
 {
 	/* make sure s->ancs have size at least s->n */
-	int n, ns, k, best_i, i;
-	int *n_hit, *c;
-	int **hits;
+	int i, k, n;
 	struct anchor_t *a;
 
-	n_hit = s->n_hit;
-	hits = s->hits;
+	a = s->ancs;
+	n = 0;
+	for (i = 0; i < s->n_seed; ++i) {
+		for (k = 0; k < s->n_hit[i]; ++k) {
+			a[n].beg = s->hits[i][k];
+			a[n].offset = s->offset[i];
+			a[n].seed = i;
+			++n;
+		}
+	}
+	rs_sort(anchor, a, a + n);
+}
+
+static inline int same_transcript(struct anchor_t *x, struct anchor_t *y)
+{
+	extern struct transcript_info_t trans;
+	return trans.idx[x->beg + x->offset] == trans.idx[y->beg + y->offset];
+}
+
+/*
+ * Groups anchors of the same begin, then chains groups of a transcript whose
+ * begins are at most band apart. Chains are ranked by number of seeds
+ */
+void chain_anchors(struct seed_t *s, int band)
+{
+	struct anchor_t *a;
+	struct anchor_chain_t *c;
+	uint64_t seeds;
+	int n, i, k, cs, bit;
+
 	a = s->ancs;
 	n = s->n;
-	ns = s->n_seed;
-	c = alloca(ns * sizeof(int));
-	memset(c, 0, ns * sizeof(int));
-	k = 0;
-	while (k < n) {
-		best_i = -1;
-		for (i = 0; i < ns; ++i) {
-			if (c[i] < n_hit[i] && (best_i == -1 ||
-			     hits[i][c[i]] < hits[best_i][c[best_i]]))
-				best_i = i;
+	c = NULL;
+	seeds = 0;
+	for (i = 0; i < n;) {
+		for (k = i; k + 1 < n && a[k].beg == a[k + 1].beg &&
+			same_transcript(a + k, a + k + 1); ++k);
+		cs = k - i + 1;
+		if (c == NULL || a[i].beg - a[i - 1].beg > band ||
+		    !same_transcript(a + i - 1, a + i)) {
+			if (s->n_chain == s->m_chain) {
+				s->m_chain <<= 1;
+				s->chains = realloc(s->chains,
+					s->m_chain * sizeof(struct anchor_chain_t));
+			}
+			c = s->chains + s->n_chain++;
+			c->beg = c->main = i;
+			c->n_main = cs;
+			c->n_diag = c->support = 0;
+			seeds = 0;
+		} else if (cs > c->n_main || (cs == c->n_main &&
+			   a[k].offset - a[i].offset > a[c->main + cs - 1].offset -
+						      a[c->main].offset)) {
+			/* ties go to the group covering more of the read */
+			c->main = i;
+			c->n_main = cs;
 		}
-		assert(best_i != -1);
-		a[k].beg = hits[best_i][c[best_i]];
-		a[k].offset = s->offset[best_i];
-		++k;
-		++c[best_i];
+		++c->n_diag;
+		for (; i <= k; ++i) {
+			bit = a[i].seed;
+			if (bit >= 64 || !(seeds >> bit & 1))
+				++c->support;
+			if (bit < 64)
+				seeds |= UINT64_C(1) << bit;
+		}
+		c->end = i;
 	}
+	rs_sort(chain, s->chains, s->chains + s->n_chain);
 }
 
 void linear_cons_anchor(char *seq, int len, struct anchor_t *a, int n,
@@ -253,6 +314,7 @@ void linear_cons_anchor(char *seq, int len, struct anchor_t *a, int n,
 
 		ret->cands[ret->n].pos = trans.tran_beg[ref_id] + ref_pos + pbeg;
 		ret->cands[ret->n].score = score;
+		ret->cands[ret->n].indel = 0;
 		ret->max_score = __max(ret->max_score, score);
 		++ret->n;
 	} else if (score >= partial_score || chain_score >= partial_score) {
@@ -358,6 +420,7 @@ void rescue_perfect(struct read_t *read, struct raw_alg_t *ret,
 			// ret->cands[ret->n].tid = ref_id;
 			ret->cands[ret->n].pos = ref_beg + trans.tran_beg[ref_id];
 			ret->cands[ret->n].score = score;
+			ret->cands[ret->n].indel = 0;
 			ret->max_score = __max(ret->max_score, score);
 			++ret->n;
 			cands[i] = cands[--ibin];
@@ -444,116 +507,140 @@ void semi_indel_map(char *seq, int len, struct recycle_alg_t *seed,
 
 		ret->cands[ret->n].pos = ref_beg + trans.tran_beg[ref_id];
 		ret->cands[ret->n].score = score;
+		ret->cands[ret->n].indel = 1;
 		ret->max_score = __max(ret->max_score, score);
 		++ret->n;
 	}
 }
 
-void get_perfect_map(struct read_t *read, struct seed_t *s,
-		     struct worker_bundle_t *bundle)
+/*
+ * Could [beg, end) of the transcriptome also be read off the genome past an
+ * exon boundary? Such reads are not covered by the window annotation
+ */
+static int cross_exon_boundary(int beg, int end)
 {
-	int n, i, k, cs, n_seed;
-	int max_score, partial_score;
-	struct anchor_t *a;
-	struct raw_alg_t *ret;
-	struct recycle_bin_t *bin;
-	bin = bundle->recycle_bin;
-	ret = bundle->alg_array;
-	a = s->ancs;
-	n = s->n;
-	n_seed = s->n_seed;
-
-	max_score = read->len * SUB_MAX;
-	partial_score = max_score * PARTIAL_RATIO;
-	for (i = 0; i < n;) {
-		for (k = i; k + 1 < n && a[k].beg == a[k + 1].beg &&
-			trans.idx[a[k].beg + a[k].offset] == trans.idx[a[k + 1].beg + a[k + 1].offset]; ++k);
-		cs = k - i + 1;
-		if (cs == n_seed)
-			linear_cons_anchor(read->seq, read->len, a + i, cs,
-					ret, bin, 0, partial_score, 0);
-		i = k + 1;
+	extern struct gene_info_t genes;
+	extern struct transcript_info_t trans;
+	struct exon_t *e;
+	int i, j, n, b;
+	i = trans.idx[__max(beg, 0)];
+	b = trans.tran_beg[i];
+	if (beg < b || end > b + trans.tran_len[i])
+		return 1;
+	n = trans.n_exon[i];
+	e = trans.exons[i];
+	for (j = 0; j + 1 < n; ++j) {
+		if (genes.strand[trans.gene_idx[i]] == 0)
+			b += e[j].end - e[j].beg + 1;
+		else
+			b += e[n - j - 1].end - e[n - j - 1].beg + 1;
+		if (b > beg && b < end)
+			return 1;
 	}
+	return 0;
 }
 
-void get_perfect_map_alt(struct read_t *read, struct seed_t *s,
-			 struct worker_bundle_t *bundle)
+/*
+ * Skip genome search if every best candidate lies on clean windows. Windows
+ * only tell about mismatch hits, not those of indel candidates
+ */
+static int check_genome_map(struct read_t *read, int err,
+			    struct worker_bundle_t *bundle)
 {
-	int n, i, k, cs, n_seed;
-	int max_score, max_err, partial_score, clip;
-	struct anchor_t *a;
-	struct raw_alg_t *ret;
-	struct recycle_bin_t *bin;
-	bin = bundle->recycle_bin;
-	ret = bundle->alg_array;
-	a = s->ancs;
-	n = s->n;
-	n_seed = s->n_seed;
-
-	max_score = read->len * SUB_MAX;
-	max_err = read->len * ERROR_RATIO;
-	partial_score = max_score * PARTIAL_RATIO;
-	clip = max_err;
-	for (i = 0; i < n;) {
-		for (k = i; k + 1 < n && a[k].beg == a[k + 1].beg &&
-			trans.idx[a[k].beg + a[k].offset] == trans.idx[a[k + 1].beg + a[k + 1].offset]; ++k);
-		cs = k - i + 1;
-		if (cs >= n_seed - 2)
-			linear_cons_anchor(read->seq, read->len, a + i, cs,
-					ret, bin, max_err, partial_score, clip);
-		i = k + 1;
+	struct raw_alg_t *algs;
+	struct align_t *a;
+	int i, clip;
+	algs = bundle->alg_array;
+	clip = read->len * ERROR_RATIO;
+	if (err > 0) {
+		/* read starts at most clip bases before its candidate */
+		for (i = 0; i < algs->n; ++i) {
+			a = algs->cands + i;
+			if (a->score == algs->max_score && (a->indel ||
+			    cross_exon_boundary(a->pos - clip, a->pos + read->len) ||
+			    genome_is_ambiguous(a->pos, read->len - clip, err)))
+				break;
+		}
+		if (i == algs->n)
+			return 1;
 	}
+	return genome_map_err(read, err, bundle);
 }
 
-void get_linear_map(struct read_t *read, struct seed_t *s, int min_s, int max_s,
-			struct worker_bundle_t *bundle)
+/*
+ * Linear check of each exact diagonal group of chain c holding [min_s, max_s]
+ * anchors. Groups of a chain only differ in begin
+ */
+static void map_chain(struct read_t *read, struct seed_t *s,
+		      struct anchor_chain_t *c, int min_s, int max_s, int max_err,
+		      int clip, struct worker_bundle_t *bundle)
 {
-	int n, i, k, cs;
-	int max_score, max_err, partial_score, clip;
 	struct anchor_t *a;
-	struct raw_alg_t *ret;
-	struct recycle_bin_t *bin;
-	bin = bundle->recycle_bin;
-	ret = bundle->alg_array;
-	a = s->ancs;
-	n = s->n;
+	int i, k, partial_score;
 
-	max_score = read->len * SUB_MAX;
-	max_err = read->len * ERROR_RATIO;
-	partial_score = max_score * PARTIAL_RATIO;
-	clip = max_err;
-	for (i = 0; i < n;) {
-		for (k = i; k + 1 < n && a[k].beg == a[k + 1].beg &&
-			trans.idx[a[k].beg + a[k].offset] == trans.idx[a[k + 1].beg + a[k + 1].offset]; ++k);
-		cs = k - i + 1;
-		if (cs >= min_s && cs <= max_s)
-			linear_cons_anchor(read->seq, read->len, a + i, cs,
-					ret, bin, max_err, partial_score, clip);
-		i = k + 1;
+	a = s->ancs;
+	partial_score = read->len * SUB_MAX * PARTIAL_RATIO;
+	for (i = c->beg; i < c->end; i = k) {
+		for (k = i + 1; k < c->end && a[k].beg == a[i].beg; ++k);
+		if (k - i >= min_s && k - i <= max_s)
+			linear_cons_anchor(read->seq, read->len, a + i, k - i,
+					bundle->alg_array, bundle->recycle_bin,
+					max_err, partial_score, clip);
 	}
 }
 
+/*
+ * Chains are ranked by support, so the candidates of the perfect and alt tiers
+ * are a prefix of them and each tier stops at the first chain below its bar.
+ * What is left after the alt tier are the chains of the linear tier
+ */
 int check_linear_map(struct read_t *read, struct worker_bundle_t *bundle)
 {
-	int err, max_err, max_score;
+	int i, k, n_seed, n_bin, err, max_err, max_score;
 	struct raw_alg_t *algs;
-	struct seed_t *s_cons;
+	struct recycle_bin_t *bin;
+	struct seed_t *s;
+	struct anchor_chain_t *c;
 
-	s_cons = bundle->seed_cons;
+	s = bundle->seed_cons;
 	algs = bundle->alg_array;
+	bin = bundle->recycle_bin;
+	n_seed = s->n_seed;
 	max_score = read->len * SUB_MAX;
 	max_err = read->len * ERROR_RATIO;
 
-	get_perfect_map(read, s_cons, bundle);
+	/* perfect: every seed on a single diagonal, no error */
+	for (i = 0; i < s->n_chain && s->chains[i].support == n_seed; ++i) {
+		c = s->chains + i;
+		if (c->n_main == n_seed)
+			map_chain(read, s, c, n_seed, n_seed, 0, 0, bundle);
+	}
 	if (algs->n)
 		goto genome_check;
 
-	rescue_perfect(read, bundle->alg_array, bundle->recycle_bin);
-	get_perfect_map_alt(read, s_cons, bundle);
+	rescue_perfect(read, algs, bin);
+	/* alt: all but two seeds, on one diagonal or across an indel */
+	for (i = 0; i < s->n_chain && s->chains[i].support >= n_seed - 2; ++i) {
+		c = s->chains + i;
+		if (c->n_diag == 1) {
+			map_chain(read, s, c, 1, n_seed, max_err, max_err, bundle);
+			continue;
+		}
+		/* every diagonal of the indel, what is binned is extended banded */
+		n_bin = bin->n;
+		map_chain(read, s, c, 1, n_seed, max_err, max_err, bundle);
+		for (k = n_bin; k < bin->n; ++k)
+			semi_indel_map(read->seq, read->len, bin->cands + k,
+				       algs, bundle->tmp_array);
+		bin->n = n_bin;
+	}
 	if (algs->n && algs->max_score >= max_score - 2 * SUB_GAP)
 		goto genome_check;
 
-	get_linear_map(read, s_cons, 1, s_cons->n_seed - 3, bundle);
+	/* linear: what is left has at most n_seed - 3 seeds on each diagonal */
+	for (; i < s->n_chain; ++i)
+		map_chain(read, s, s->chains + i, 1, n_seed - 3, max_err,
+			  max_err, bundle);
 	if (algs->n)
 		goto genome_check;
 
@@ -561,7 +648,7 @@ int check_linear_map(struct read_t *read, struct worker_bundle_t *bundle)
 
 genome_check:
 	err = (max_score - algs->max_score + SUB_GAP - 1) / SUB_GAP;
-	return genome_map_err(read, __min(max_err, err), bundle);
+	return check_genome_map(read, __min(max_err, err), bundle);
 }
 
 int check_indel_map(struct read_t *read, struct worker_bundle_t *bundle)
@@ -594,16 +681,19 @@ int check_indel_map(struct read_t *read, struct worker_bundle_t *bundle)
 		err = -max_err;
 	}
 
-	return genome_map_err(read, err, bundle);
+	return check_genome_map(read, err, bundle);
 }
 
-void store_read_chromium(struct read_t *r, struct raw_alg_t *alg,
-			struct kmhash_t *bc_table, pthread_mutex_t *lock_hash,
-			struct library_t lib)
+void store_read_chromium(struct read_t *r, struct worker_bundle_t *bundle)
 {
+	struct raw_alg_t *alg;
+	struct library_t lib;
 	int i, g, gene;
 	uint64_t bc_idx, umi_gene_idx;
 
+	alg = bundle->alg_array;
+	lib = bundle->lib;
+
 	gene = -1;
 	for (i = 0; i < alg->n; ++i) {
 		if (alg->cands[i].score < alg->max_score)
@@ -619,13 +709,24 @@ void store_read_chromium(struct read_t *r, struct raw_alg_t *alg,
 	}
 	if (gene == -1)
 		return;
-	bc_idx = umi_gene_idx = 0;
-	for (i = 0; i < lib.bc_len; ++i)
-		bc_idx = bc_idx * 5 + nt4_table[(int)r->seq[i]];
-	for (i = 0; i < lib.umi_len; ++i)
-		umi_gene_idx = umi_gene_idx * 5 + nt4_table[(int)r->seq[lib.bc_len + i]];
+	bc_idx = barcode2num(r->seq, lib.bc_len);
+	if (bc_idx == TOMB_STONE)
+		return;
+	if (bundle->bc_allow && bc_count_get(bundle->bc_allow, bc_idx) == KMHASH_MAX_SIZE)
+		return;
+	/* UMIs with N are put removed, the barcode still has the read */
+	if (seq_n_pos(r->seq + lib.bc_len, lib.umi_len) != -1)
+		gene = genes.n;
+	umi_gene_idx = seq2num(r->seq + lib.bc_len, lib.umi_len);
 	umi_gene_idx = umi_gene_idx << GENE_BIT_LEN | gene;
-	kmhash_put_bc_umi(bc_table, lock_hash, bc_idx, umi_gene_idx);
+	if (bundle->bc_buf)
+		bc_buffer_put(bundle->bc_buf, bc_idx, umi_gene_idx);
+	else if (bundle->bc_part)
+		bc_partition_put(bundle->bc_part, bundle->thread_no,
+				 bc_idx, umi_gene_idx);
+	else
+		kmhash_put_bc_umi(bundle->bc_table, bundle->lock_hash,
+				  bc_idx, umi_gene_idx);
 }
 
 /*
@@ -710,14 +811,15 @@ void align_chromium_read(struct read_t *read1, struct read_t *read2,
 	s_cons = bundle->seed_cons;
 	find_cons_seeds(read2, s_cons);
 	merge_seed(s_cons);
+	/* as far off a diagonal as the banded extension reaches */
+	chain_anchors(s_cons, (int)(read2->len * ERROR_RATIO) * SUB_GAP_RATIO);
 
 	ret = check_linear_map(read2, bundle);
 	if (ret == 0)
 		ret = check_indel_map(read2, bundle);
 
 	if (ret == 1){
-		store_read_chromium(read1, bundle->alg_array, bundle->bc_table,
-					bundle->lock_hash, bundle->lib);
+		store_read_chromium(read1, bundle);
 		// store_exon(read1, bundle->alg_array);
 		++bundle->result->exon;
 	} else if (ret == 2) {
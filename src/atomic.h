@@ -17,6 +17,8 @@
 #define __sync_val_compare_and_swap8(ptr, a, v) _InterlockedCompareExchange8(ptr, v, a)
 #define __sync_bool_compare_and_swap8(ptr, a, v) (_InterlockedCompareExchange8(ptr, v, a) == (a))
 
+#define __sync_full_barrier MemoryBarrier
+
 #else
 #define __sync_fetch_and_add8 __sync_fetch_and_add
 #define __sync_val_compare_and_swap8(ptr, a, v) __sync_val_compare_and_swap(ptr, a, v)
@@ -29,5 +31,7 @@
 #define __sync_fetch_and_add64 __sync_fetch_and_add
 #define __sync_val_compare_and_swap64(ptr, a, v) __sync_val_compare_and_swap(ptr, a, v)
 #define __sync_bool_compare_and_swap64(ptr, a, v) __sync_bool_compare_and_swap(ptr, a, v)
+
+#define __sync_full_barrier __sync_synchronize
 #endif
 #endif
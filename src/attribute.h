@@ -21,6 +21,10 @@
 
 #define NNU			4
 
+/* Barcode and UMI encoding takes 2 bits per base (see seq2num) */
+#define MAX_BC_LEN		32
+#define MAX_UMI_LEN		21
+
 #define MAX_PATH		4096
 
 #ifdef HERA_64_BIT
@@ -3,34 +3,167 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <zlib.h>
 
 #include "barcode.h"
 #include "io_utils.h"
+#include "atomic.h"
 #include "kmhash.h"
+#include "radix_sort.h"
+#include "thread_pool.h"
 #include "verbose.h"
 #include "utils.h"
 
 #define CUT_OFF_THRES			0.01
+/* read counts saturate slower than UMI counts, be loose on candidates */
+#define CANDIDATE_THRES			(CUT_OFF_THRES / 10)
+/* a spilled UMI is loaded, grouped by cell, then hashed with its count */
+#define SPILL_UMI_BYTES			(2 * sizeof(struct bc_umi_t) +	       \
+					 sizeof(kmkey_t) + sizeof(uint32_t))
+/* UMIs are clustered per gene on gene << UMI_KEY_BITS | umi keys */
+#define UMI_KEY_BITS			(MAX_UMI_LEN << 1)
 
 #define __get_gene(x) ((int)((x) & GENE_MASK))
 #define __get_umi(x) ((x) >> GENE_BIT_LEN)
 
+#define gene_get_block(x, s, mask) ((x) >> (s) & (mask))
+#define gene_less_than(x, y) ((x) < (y))
+
+RS_IMPL(gene, uint32_t, 24, 8, gene_less_than, gene_get_block)
+
+#define umi_get_block(x, s, mask) ((x) >> (s) & (mask))
+#define umi_less_than(x, y) ((x) < (y))
+
+RS_IMPL(umi, uint64_t, 64, 8, umi_less_than, umi_get_block)
+
+#define cu_get_block(x, s, mask) ((x).umi >> (s) & (mask))
+#define cu_less_than(x, y) ((x).umi < (y).umi)
+
+RS_IMPL(cell_umi, struct bc_umi_t, 64, 8, cu_less_than, cu_get_block)
+
+/* UMI without N of a cell, pos is its bucket in the cell's UMI hash */
+struct umi_rec_t {
+	uint64_t key;
+	uint32_t cnt;
+	kmint_t pos;
+};
+
+#define ur_get_block(x, s, mask) ((x).key >> (s) & (mask))
+#define ur_less_than(x, y) ((x).key < (y).key)
+
+RS_IMPL(umi_rec, struct umi_rec_t, 48, 8, ur_less_than, ur_get_block)
+
+#define __rec_gene(x) ((x) >> UMI_KEY_BITS)
+
+/*
+ * Scratch of the UMI clustering, reused across the cells of a worker.
+ * Edges are (src << 32 | dst), those of node u are edge[eoff[u], eoff[u + 1])
+ */
+struct umi_engine_t {
+	struct umi_rec_t *rec;
+	uint64_t *tmp;
+	uint32_t *eoff;
+	uint32_t *queue;
+	uint8_t *visited;
+	size_t m;
+	uint64_t *edge;
+	size_t n_edges;
+	size_t m_edges;
+};
+
 struct sc_cell_t {
 	uint64_t idx;
 	uint32_t cnt_umi;
 	struct umi_hash_t *h;
 };
 
+#define MTX_BLOCK_SIZE			64
+/* chunks of cells per thread, the fewer UMIs a cell has the more cells a
+ * chunk takes, up to a block */
+#define UMI_CHUNKS_PER_THREAD		16
+/* header line is rewritten with the number of entries once all are known */
+#define MTX_NNZ_WIDTH			20
+
+/* Text of one output file or of one block of cells */
+struct text_buf_t {
+	char *s;
+	size_t l;
+	size_t m;
+};
+
+/* Gene counts of one chunk of cells, never more than a block */
+struct cell_block_t {
+	uint32_t *gene;
+	uint32_t *cnt;
+	int n[MTX_BLOCK_SIZE];		// entries of each cell
+	size_t l;
+	size_t m;
+};
+
+#define CSC_ALIGN			4096
+#define CSC_VERSION			1
+#define CSC_COPY_SIZE			SIZE_1MB
+
+#define __csc_align(x) (((x) + CSC_ALIGN - 1) / CSC_ALIGN * CSC_ALIGN)
+
+/*
+ * Header of matrix.csc, little-endian, every section starts at a multiple
+ * of CSC_ALIGN. Cell j holds indices[indptr[j]..indptr[j + 1]) (0-based
+ * genes, uint32) and data of the same range (uint32), indptr is uint64.
+ * A string table is uint64 offsets[n + 1] followed by the bytes
+ */
+struct csc_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t align;
+	uint64_t n_genes;
+	uint64_t n_cells;
+	uint64_t nnz;
+	uint64_t indptr;
+	uint64_t indices;
+	uint64_t data;
+	uint64_t barcodes;
+	uint64_t feature_ids;
+	uint64_t feature_names;
+};
+
+struct csc_writer_t {
+	FILE *fp;
+	FILE *fdata;			// data until nnz is known
+	char data_path[MAX_PATH];
+	struct csc_header_t hdr;
+	uint64_t nnz;			// entries written so far
+};
+
+/* One matrix with its barcodes and features, cells are CBs[0..n_cells) */
+struct mtx_out_t {
+	int n_cells;
+	int gz;				// each chunk is one gzip member
+	FILE *fmtx;
+	struct text_buf_t hdr;
+	struct text_buf_t zhdr;
+	size_t nnz_pos;
+	size_t zhdr_len;
+	uint64_t n_lines;
+	struct csc_writer_t *csc;
+};
+
+/* The filtered matrix first, then the raw one if asked */
 struct umi_bundle_t {
 	int n_threads;
 	int thread_no;
-	pthread_mutex_t *lock;
-	FILE *fbin;
-	uint64_t *n_lines;
+	int *next_chunk;		// next chunk of cells to count
+	int n_chunks;
+	int *chunk;			// cells of chunk c are [chunk[c], chunk[c + 1])
+	volatile int *n_written;	// chunks already in the matrices
+	struct mtx_out_t *outs;
+	int n_outs;
+	/* with a spill, UMIs of cells [first_cell, ...) grouped by cell */
+	int first_cell;
+	struct bc_umi_t *umis;
+	size_t *umi_beg;
 };
 
-const uint64_t pow5_r[] = {1ull, 5ull, 25ull, 125ull, 625ull, 3125ull, 15625ull, 78125ull, 390625ull, 1953125ull, 9765625ull, 48828125ull, 244140625ull, 1220703125ull, 6103515625ull, 30517578125ull, 152587890625ull, 762939453125ull, 3814697265625ull, 19073486328125ull, 95367431640625ull, 476837158203125ull, 2384185791015625ull, 11920928955078125ull, 59604644775390625ull, 298023223876953125ull, 1490116119384765625ull};
-
 struct sc_cell_t *CBs;
 int32_t n_bc;
 int16_t bc_len, umi_len;
@@ -43,94 +176,266 @@ void init_barcode(struct gene_info_t *g, struct library_t lib)
 
 	bc_len = lib.bc_len;
 	umi_len = lib.umi_len;
+	if (bc_len > MAX_BC_LEN || umi_len > MAX_UMI_LEN)
+		__ERROR("Barcode length [%d] or UMI length [%d] exceeds limit [%d, %d]",
+			bc_len, umi_len, MAX_BC_LEN, MAX_UMI_LEN);
 }
 
-static void insertion_sort(struct sc_cell_t *b, struct sc_cell_t *e)
+/*
+ * Barcodes with several N, or with an N and no room to keep its position,
+ * could never be corrected to a cell. A 32 bases poly-T is TOMB_STONE as well
+ */
+uint64_t barcode2num(const char *seq, int len)
 {
-	struct sc_cell_t *i, *j, tmp;
-	for (i = b + 1; i < e; ++i) {
-		if (i->cnt_umi > (i - 1)->cnt_umi) {
-			tmp = *i;
-			for (j = i; j > b && tmp.cnt_umi > (j - 1)->cnt_umi; j--)
-				*j = *(j - 1);
-			*j = tmp;
-		}
-	}
+	uint64_t idx;
+	int n;
+	n = seq_n_pos(seq, len);
+	if (n == -2 || (n >= 0 && !__enc_N_room(len)))
+		return TOMB_STONE;
+	idx = seq2num(seq, len);
+	if (n >= 0)
+		idx |= __enc_N(n);
+	return idx;
 }
 
-void merge_sort(struct sc_cell_t *a, int l, int r, int m, struct sc_cell_t *tmp)
+/*
+ * Hamming neighbours of the j-th base are obtained by XOR on its 2 bits, an
+ * N (stored as A) at j is first cleared so that all 4 bases are tried.
+ * Returns the base to XOR and sets the first XOR value
+ */
+static inline uint64_t neighbour_base(uint64_t idx, int j, int len, int *d)
 {
-	struct sc_cell_t *a1, *a2;
-	int len1, len2, i1, i2, k;
-	len1 = m - l;
-	len2 = r - m;
-	memcpy(tmp, a + l, len1 * sizeof(struct sc_cell_t));
+	if (__enc_N_pos(idx, len) == j) {
+		*d = 0;
+		return __enc_clear_N(idx);
+	}
+	*d = 1;
+	return idx;
+}
 
-	a1 = tmp;
-	a2 = a + m;
-	a = a + l;
+/* Ties are broken by barcode so that the order does not depend on the
+ * layout of the barcodes hash */
+#define __cb_gt(x, y) ((x).cnt_umi > (y).cnt_umi ||			       \
+		       ((x).cnt_umi == (y).cnt_umi && (x).idx < (y).idx))
 
-	i1 = i2 = k = 0;
-	while (i1 < len1 && i2 < len2) {
-		if (a1[i1].cnt_umi > a2[i2].cnt_umi)
-			a[k++] = a1[i1++];
-		else
-			a[k++] = a2[i2++];
-	}
+#define CB_RADIX_BITS			8
+#define CB_RADIX_SIZE			(1 << CB_RADIX_BITS)
+#define CB_RADIX_MASK			(CB_RADIX_SIZE - 1)
+#define CB_SORT_MIN_PARALLEL		0x10000
+
+/* Digit of a cell at shift s, shifts from 64 on are digits of ~cnt_umi */
+#define __cb_digit(x, s) ((int)((s) < 64 ? ((x).idx >> (s)) & CB_RADIX_MASK :  			(~(x).cnt_umi >> ((s) - 64)) & CB_RADIX_MASK))
 
-	if (i1 < len1)
-		memcpy(a + k, a1 + i1, (len1 - i1) * sizeof(struct sc_cell_t));
+struct cbsort_bundle_t {
+	int n_threads;
+	int thread_no;
+	int n;
+	int n_pass;
+	int *shift;
+	struct sc_cell_t **buf;
+	int *cnt;
+	pthread_barrier_t *barrier;
+};
 
-	if (i2 < len2)
-		memcpy(a + k, a2 + i2, (len2 - i2) * sizeof(struct sc_cell_t));
+/*
+ * One LSD pass per digit: each thread counts its slice, thread 0 turns the
+ * counts into offsets (digit major, thread minor) and every thread scatters
+ * its slice, which keeps the sort stable
+ */
+void *cbsort_worker(void *data)
+{
+	struct cbsort_bundle_t *bundle = (struct cbsort_bundle_t *)data;
+	struct sc_cell_t *src, *dst;
+	int p, i, d, t, s, beg, end, sum, tmp, *cnt;
+
+	beg = (int64_t)bundle->n * bundle->thread_no / bundle->n_threads;
+	end = (int64_t)bundle->n * (bundle->thread_no + 1) / bundle->n_threads;
+	cnt = bundle->cnt + bundle->thread_no * CB_RADIX_SIZE;
+	for (p = 0; p < bundle->n_pass; ++p) {
+		src = bundle->buf[p & 1];
+		dst = bundle->buf[(p & 1) ^ 1];
+		s = bundle->shift[p];
+		memset(cnt, 0, CB_RADIX_SIZE * sizeof(int));
+		for (i = beg; i < end; ++i)
+			++cnt[__cb_digit(src[i], s)];
+		pthread_barrier_wait(bundle->barrier);
+		if (bundle->thread_no == 0) {
+			sum = 0;
+			for (d = 0; d < CB_RADIX_SIZE; ++d) {
+				for (t = 0; t < bundle->n_threads; ++t) {
+					tmp = bundle->cnt[t * CB_RADIX_SIZE + d];
+					bundle->cnt[t * CB_RADIX_SIZE + d] = sum;
+					sum += tmp;
+				}
+			}
+		}
+		pthread_barrier_wait(bundle->barrier);
+		for (i = beg; i < end; ++i)
+			dst[cnt[__cb_digit(src[i], s)]++] = src[i];
+		pthread_barrier_wait(bundle->barrier);
+	}
+	return NULL;
 }
 
-void sort_CBs()
+/* Sort a[0..n) by decreasing UMI count, ties by barcode */
+void sort_CBs(struct sc_cell_t *a, int n, int n_threads)
 {
-	extern int n_bc;
-	extern struct sc_cell_t *CBs;
+	struct cbsort_bundle_t *bundles;
+	struct sc_cell_t *buf[2];
+	pthread_barrier_t barrier;
+	uint64_t idx_or, idx_and;
+	uint32_t cnt_or, cnt_and;
+	int i, s, n_pass, shift[(64 + 32) / CB_RADIX_BITS], *cnt;
+
+	if (n <= 1)
+		return;
+
+	/* skip digits which are the same for all cells */
+	idx_or = cnt_or = 0;
+	idx_and = (uint64_t)-1;
+	cnt_and = (uint32_t)-1;
+	for (i = 0; i < n; ++i) {
+		idx_or |= a[i].idx;
+		idx_and &= a[i].idx;
+		cnt_or |= ~a[i].cnt_umi;
+		cnt_and &= ~a[i].cnt_umi;
+	}
+	n_pass = 0;
+	for (s = 0; s < 64; s += CB_RADIX_BITS)
+		if (((idx_or ^ idx_and) >> s) & CB_RADIX_MASK)
+			shift[n_pass++] = s;
+	for (s = 0; s < 32; s += CB_RADIX_BITS)
+		if (((cnt_or ^ cnt_and) >> s) & CB_RADIX_MASK)
+			shift[n_pass++] = 64 + s;
+
+	if (n < CB_SORT_MIN_PARALLEL)
+		n_threads = 1;
+
+	buf[0] = a;
+	buf[1] = malloc(n * sizeof(struct sc_cell_t));
+	cnt = malloc(n_threads * CB_RADIX_SIZE * sizeof(int));
+	pthread_barrier_init(&barrier, NULL, n_threads);
+
+	bundles = calloc(n_threads, sizeof(struct cbsort_bundle_t));
+	for (i = 0; i < n_threads; ++i) {
+		bundles[i].n_threads = n_threads;
+		bundles[i].thread_no = i;
+		bundles[i].n = n;
+		bundles[i].n_pass = n_pass;
+		bundles[i].shift = shift;
+		bundles[i].buf = buf;
+		bundles[i].cnt = cnt;
+		bundles[i].barrier = &barrier;
+	}
+	thread_pool_run(cbsort_worker, bundles, sizeof(struct cbsort_bundle_t), n_threads);
+
+	if (n_pass & 1)
+		memcpy(a, buf[1], n * sizeof(struct sc_cell_t));
 
-	int i, buck_size, l, r, m;
-	struct sc_cell_t *tmp;
+	pthread_barrier_destroy(&barrier);
+	free(bundles);
+	free(cnt);
+	free(buf[1]);
+}
 
-	tmp = malloc(n_bc * sizeof(struct sc_cell_t));
+#define BC_CHUNK_SIZE			1024
 
-	buck_size = 64;
-	for (i = 0; i < n_bc; i += buck_size)
-		insertion_sort(CBs + i, CBs + __min(i + buck_size, n_bc));
+struct bc_bundle_t {
+	struct kmhash_t *h;
+	int n_threads;
+	int *next;		// next chunk to scan
+	int *first;		// first barcode having a bigger neighbour
+	int *dst;		// destination of barcodes to be corrected
+	int *merge_beg;		// sources merged into each cell
+	int *merge_src;
+	struct bc_count_t *bc_count;	// read count of barcodes from read 1
+	uint32_t cand_cnt;	// read count of candidate cells
+	uint8_t *keep;
+	struct bc_spill_t *spill;	// UMIs of barcodes by partition
+	struct bc_spill_t *cells;	// UMIs of columns by block of cells
+	int n_cols;
+	int *next_file;
+};
 
-	for (i = buck_size; i < n_bc; i <<= 1) {
-		for (l = 0; l < n_bc; l += (i << 1)) {
-			r = __min(l + (i << 1), n_bc);
-			m = __min(l + i, r);
-			merge_sort(CBs, l, r, m, tmp);
+static void run_bc_workers(void *(*func)(void *), struct bc_bundle_t *bundle)
+{
+	*bundle->next = 0;
+	thread_pool_run(func, bundle, 0, bundle->n_threads);
+}
+
+static int has_bigger_neighbour(struct kmhash_t *h, int i)
+{
+	uint64_t bc_idx, new_bc, tmp_idx;
+	kmint_t k;
+	int j, d;
+	bc_idx = CBs[i].idx;
+	for (j = 0; j < bc_len; ++j) {
+		tmp_idx = neighbour_base(bc_idx, j, bc_len, &d);
+		for (; d < NNU; ++d) {
+			new_bc = tmp_idx ^ ((uint64_t)d << (j << 1));
+			k = kmhash_get(h, new_bc);
+			if (k < KMHASH_MAX_SIZE && h->bucks[k].umis->n_items >= CBs[i].cnt_umi)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* Chunks beyond the first barcode found so far are skipped */
+void *cut_off_worker(void *data)
+{
+	struct bc_bundle_t *bundle = (struct bc_bundle_t *)data;
+	int i, beg, end, cur;
+
+	while ((beg = __sync_fetch_and_add32(bundle->next, BC_CHUNK_SIZE)) < n_bc) {
+		end = __min(beg + BC_CHUNK_SIZE, n_bc);
+		for (i = beg; i < end && i < *bundle->first; ++i) {
+			if (!has_bigger_neighbour(bundle->h, i))
+				continue;
+			cur = *bundle->first;
+			while (i < cur && !__sync_bool_compare_and_swap32(bundle->first, cur, i))
+				cur = *bundle->first;
+			break;
 		}
 	}
-	free(tmp);
+	return NULL;
 }
 
-void cut_off_barcode(struct kmhash_t *h)
+void cut_off_barcode(struct kmhash_t *h, int n_threads)
 {
 	extern int n_bc;
 	extern struct sc_cell_t *CBs;
+	struct bc_bundle_t bundle;
+	struct sc_cell_t tmp;
 	kmint_t k;
-	int i, j, flag, ch, c;
-	uint64_t bc_idx, new_bc, tmp_idx;
-	uint32_t cut_off;
+	int i, next, first, n_head;
+	uint32_t cut_off, max_cnt;
 	CBs = malloc(h->n_items * sizeof(struct sc_cell_t));
 	n_bc = 0;
+	max_cnt = 0;
 	for (k = 0; k < h->size; ++k) {
 		if (h->bucks[k].idx == TOMB_STONE)
 			continue;
 		CBs[n_bc].idx = h->bucks[k].idx;
 		CBs[n_bc].cnt_umi = h->bucks[k].umis->n_items;
 		CBs[n_bc].h = h->bucks[k].umis;
+		max_cnt = __max(max_cnt, CBs[n_bc].cnt_umi);
 		++n_bc;
 	}
 	
  	//__VERBOSE("Number of raw barcodes: %d\n", n_bc);
 
-	sort_CBs();
+	/* only barcodes above the cut-off can be cells, the tail stays unsorted */
+	cut_off = CUT_OFF_THRES * max_cnt;
+	n_head = 0;
+	for (i = 0; i < n_bc; ++i) {
+		if (CBs[i].cnt_umi >= cut_off) {
+			tmp = CBs[i];
+			CBs[i] = CBs[n_head];
+			CBs[n_head++] = tmp;
+		}
+	}
+	sort_CBs(CBs, n_head, n_threads);
 
 	h->pos = malloc(h->size * sizeof(int));
 	
@@ -139,313 +444,1076 @@ void cut_off_barcode(struct kmhash_t *h)
 		h->pos[k] = i;
 	}
 
-	for (i = 0; i < n_bc; ++i) {
-		bc_idx = CBs[i].idx;
-		flag = 0;
-		for (j = 0; j < bc_len; ++j) {
-			ch = (bc_idx / pow5_r[j]) % 5;
-			tmp_idx = bc_idx - pow5_r[j] * ch;
-			for (c = 0; c < NNU; ++c) {
-				if (ch == c)
-					continue;
-				new_bc = tmp_idx + pow5_r[j] * c;
-				k = kmhash_get(h, new_bc);
-				if (k < KMHASH_MAX_SIZE && h->bucks[k].umis->n_items >= CBs[i].cnt_umi) {
-					flag = 1;
-					break;
-				}
-			}
-			if (flag)
-				break;
-		}
-		if (flag) {
-			n_bc = i;
-			break;
-		}
-	}
+	memset(&bundle, 0, sizeof(struct bc_bundle_t));
+	bundle.h = h;
+	bundle.n_threads = n_threads;
+	bundle.next = &next;
+	first = n_bc = n_head;
+	bundle.first = &first;
+	run_bc_workers(cut_off_worker, &bundle);
+	n_bc = first;
+}
 
-	cut_off = CUT_OFF_THRES * CBs[0].cnt_umi;
-	for (i = 0; i < n_bc; ++i) {
-		if (CBs[i].cnt_umi < cut_off) {
-			n_bc = i;
-			break;
+/* Cell a barcode is corrected to, -1 if none or ambiguous */
+static int correct_dst(struct kmhash_t *h, int i)
+{
+	uint64_t bc_idx, cur_bc, tmp_idx;
+	int k, d, cnt_new, dst;
+	kmint_t iter;
+	bc_idx = CBs[i].idx;
+	cnt_new = 0;
+	dst = -1;
+	for (k = 0; k < bc_len; ++k) {
+		tmp_idx = neighbour_base(bc_idx, k, bc_len, &d);
+		for (; d < NNU; ++d) {
+			cur_bc = tmp_idx ^ ((uint64_t)d << (k << 1));
+			iter = kmhash_get(h, cur_bc);
+			if (iter < KMHASH_MAX_SIZE && h->pos[iter] < n_bc) {
+				++cnt_new;
+				dst = h->pos[iter];
+			}
 		}
 	}
+	return cnt_new == 1 ? dst : -1;
 }
 
-static void merge_umi(struct kmhash_t *h, uint64_t dst_bc, uint64_t src_bc)
+static void merge_umi(struct kmhash_t *h, int dst, int src)
 {
-	kmint_t dst_k, src_k, k;
+	kmint_t src_k, k;
 	struct umi_hash_t *dst_umi, *src_umi;
-	dst_k = kmhash_get(h, dst_bc);
-	src_k = kmhash_get(h, src_bc);
-	assert(dst_k != KMHASH_MAX_SIZE);
+	src_k = kmhash_get(h, CBs[src].idx);
 	assert(src_k != KMHASH_MAX_SIZE);
-	dst_umi = h->bucks[dst_k].umis;
-	src_umi = h->bucks[src_k].umis;
+	dst_umi = CBs[dst].h;
+	src_umi = CBs[src].h;
 	for (k = 0; k < src_umi->size; ++k) {
 		if (src_umi->bucks[k] == TOMB_STONE)
 			continue;
-		umihash_put_umi_single(dst_umi, src_umi->bucks[k]);
+		umihash_put_umi_single(dst_umi, src_umi->bucks[k],
+				       __umihash_cnt(src_umi)[k]);
 	}
 	umihash_destroy(src_umi);
 	h->bucks[src_k].umis = NULL;
+	h->pos[src_k] = dst;
+	CBs[src].h = NULL;
 }
 
-void correct_barcode(struct kmhash_t *h)
+void *correct_scan_worker(void *data)
+{
+	struct bc_bundle_t *bundle = (struct bc_bundle_t *)data;
+	int i, beg, end, l;
+	l = (int)bundle->h->n_items;
+	while ((beg = n_bc + __sync_fetch_and_add32(bundle->next, BC_CHUNK_SIZE)) < l) {
+		end = __min(beg + BC_CHUNK_SIZE, l);
+		for (i = beg; i < end; ++i)
+			bundle->dst[i - n_bc] = correct_dst(bundle->h, i);
+	}
+	return NULL;
+}
+
+/* Each cell is merged by one thread, sources by decreasing UMI count */
+void *correct_merge_worker(void *data)
+{
+	struct bc_bundle_t *bundle = (struct bc_bundle_t *)data;
+	int i, j, k, src, *b, *e;
+	while ((i = __sync_fetch_and_add32(bundle->next, 1)) < n_bc) {
+		b = bundle->merge_src + bundle->merge_beg[i];
+		e = bundle->merge_src + bundle->merge_beg[i + 1];
+		/* at most 3 * bc_len sources, order them as the sorted cells */
+		for (j = 1; j < e - b; ++j) {
+			src = b[j];
+			for (k = j; k > 0 && __cb_gt(CBs[src], CBs[b[k - 1]]); --k)
+				b[k] = b[k - 1];
+			b[k] = src;
+		}
+		for (k = 0; k < e - b; ++k)
+			merge_umi(bundle->h, i, b[k]);
+	}
+	return NULL;
+}
+
+void correct_barcode(struct kmhash_t *h, int n_threads)
 {
 	extern int n_bc;
 	extern struct sc_cell_t *CBs;
-	uint64_t bc_idx, cur_bc, new_bc, tmp_idx;
-	int l, i, k, ch, c, cnt_new;
-	kmint_t iter;
+	struct bc_bundle_t bundle;
+	int l, i, next, n_merge;
 	l = (int)h->n_items;
-	for (i = n_bc; i < l; ++i) {
-		bc_idx = CBs[i].idx;
-		cnt_new = 0;
-		new_bc = 0;
-		for (k = 0; k < bc_len; ++k) {
-			ch = (bc_idx / pow5_r[k]) % 5;
-			tmp_idx = bc_idx - ch * pow5_r[k];
-			for (c = 0; c < NNU; ++c) {
-				if (ch == c)
-					continue;
-				cur_bc = tmp_idx + pow5_r[k] * c;
-				iter = kmhash_get(h, cur_bc);
-				if (iter < KMHASH_MAX_SIZE && h->pos[iter] < n_bc) {
-					++cnt_new;
-					new_bc = cur_bc;
-				}
-			}
+
+	memset(&bundle, 0, sizeof(struct bc_bundle_t));
+	bundle.h = h;
+	bundle.n_threads = n_threads;
+	bundle.next = &next;
+	bundle.dst = malloc((l - n_bc) * sizeof(int));
+	run_bc_workers(correct_scan_worker, &bundle);
+
+	/* group merges by destination cell */
+	bundle.merge_beg = calloc(n_bc + 1, sizeof(int));
+	n_merge = 0;
+	for (i = 0; i < l - n_bc; ++i) {
+		if (bundle.dst[i] >= 0) {
+			++bundle.merge_beg[bundle.dst[i] + 1];
+			++n_merge;
 		}
-		if (cnt_new == 1)
-			merge_umi(h, new_bc, bc_idx);
+	}
+	for (i = 0; i < n_bc; ++i)
+		bundle.merge_beg[i + 1] += bundle.merge_beg[i];
+	bundle.merge_src = malloc(n_merge * sizeof(int));
+	for (i = 0; i < l - n_bc; ++i)
+		if (bundle.dst[i] >= 0)
+			bundle.merge_src[bundle.merge_beg[bundle.dst[i]]++] = n_bc + i;
+	for (i = n_bc; i > 0; --i)
+		bundle.merge_beg[i] = bundle.merge_beg[i - 1];
+	bundle.merge_beg[0] = 0;
+	run_bc_workers(correct_merge_worker, &bundle);
+
+	free(bundle.dst);
+	free(bundle.merge_beg);
+	free(bundle.merge_src);
+}
+
+/*
+ * Barcodes left after correction follow the cells in CBs, sorted the same
+ * way. Returns the number of raw barcodes
+ */
+static int collect_raw_barcodes(int l, int n_threads)
+{
+	int i, n_raw;
+	n_raw = n_bc;
+	for (i = n_bc; i < l; ++i)
+		if (CBs[i].h)
+			CBs[n_raw++] = CBs[i];
+	sort_CBs(CBs + n_bc, n_raw - n_bc, n_threads);
+	return n_raw;
+}
+
+/*
+ * Each partition of spilled UMIs is given the columns of its barcodes and
+ * written again as one run grouped by block of columns
+ */
+void *spill_cells_worker(void *data)
+{
+	struct bc_bundle_t *bundle = (struct bc_bundle_t *)data;
+	struct bc_umi_t *a, *tmp;
+	size_t *cnt, *off, i, n, m;
+	int p, f, c, n_blocks;
+
+	n_blocks = bundle->cells->n_parts;
+	f = __sync_fetch_and_add32(bundle->next_file, 1);
+	cnt = malloc(__max(n_blocks, 1) * sizeof(size_t));
+	off = malloc(__max(n_blocks, 1) * sizeof(size_t));
+	while ((p = __sync_fetch_and_add32(bundle->next, 1)) < bundle->spill->n_parts) {
+		n = bc_spill_load(bundle->spill, p, p + 1, &a);
+		memset(cnt, 0, n_blocks * sizeof(size_t));
+		for (i = m = 0; i < n; ++i) {
+			c = bundle->h->pos[kmhash_get(bundle->h, a[i].bc)];
+			if (c >= bundle->n_cols)
+				continue;
+			a[m] = a[i];
+			a[m++].bc = c;
+			++cnt[c / MTX_BLOCK_SIZE];
+		}
+		if (n_blocks)
+			off[0] = 0;
+		for (c = 1; c < n_blocks; ++c)
+			off[c] = off[c - 1] + cnt[c - 1];
+		tmp = malloc(__max(m, 1) * sizeof(struct bc_umi_t));
+		for (i = 0; i < m; ++i)
+			tmp[off[a[i].bc / MTX_BLOCK_SIZE]++] = a[i];
+		bc_spill_write(bundle->cells, f, tmp, cnt);
+		free(tmp);
+		bc_spill_unload(bundle->spill, a, n);
+	}
+	free(cnt);
+	free(off);
+	return NULL;
+}
+
+/*
+ * Cells and the raw barcodes after them are their own column, a merged
+ * barcode takes the column of its cell and the others are dropped. UMI
+ * counts of the table are not needed anymore, UMIs are read back from the
+ * returned spill one range of blocks of cells at a time
+ */
+static struct bc_spill_t *spill_cells(struct kmhash_t *h, struct bc_spill_t *sp,
+				      int n_cols, struct opt_count_t *opt)
+{
+	struct bc_bundle_t bundle;
+	struct bc_spill_t *cells;
+	char path[MAX_PATH];
+	int i, next, next_file;
+	kmint_t k;
+
+	for (i = n_bc; i < n_cols; ++i)
+		h->pos[kmhash_get(h, CBs[i].idx)] = i;
+	for (k = 0; k < h->size; ++k) {
+		umihash_destroy(h->bucks[k].umis);
+		h->bucks[k].umis = NULL;
+	}
+	for (i = 0; i < n_cols; ++i)
+		CBs[i].h = NULL;
+
+	strcpy(path, opt->temp_dir); strcat(path, "/");
+	strcat(path, opt->prefix); strcat(path, ".cell.spill");
+	cells = init_bc_spill(path, (n_cols + MTX_BLOCK_SIZE - 1) / MTX_BLOCK_SIZE,
+			      opt->n_threads, 0);
+
+	memset(&bundle, 0, sizeof(struct bc_bundle_t));
+	bundle.h = h;
+	bundle.n_threads = opt->n_threads;
+	bundle.next = &next;
+	bundle.spill = sp;
+	bundle.cells = cells;
+	bundle.n_cols = n_cols;
+	next_file = 0;
+	bundle.next_file = &next_file;
+	run_bc_workers(spill_cells_worker, &bundle);
+	return cells;
+}
+
+/* UMIs of the blocks of cells [beg, end) grouped by cell */
+static void load_cell_range(struct bc_spill_t *cells, int beg, int end,
+			    int n_cols, struct umi_bundle_t *bundle)
+{
+	struct bc_umi_t *a;
+	size_t i, n, *umi_beg;
+	int c, n_cells, first;
+
+	first = beg * MTX_BLOCK_SIZE;
+	n_cells = __min(end * MTX_BLOCK_SIZE, n_cols) - first;
+	n = bc_spill_load(cells, beg, end, &a);
+	umi_beg = calloc(n_cells + 1, sizeof(size_t));
+	for (i = 0; i < n; ++i)
+		++umi_beg[a[i].bc - first + 1];
+	for (c = 0; c < n_cells; ++c)
+		umi_beg[c + 1] += umi_beg[c];
+	bundle->umis = malloc(__max(n, 1) * sizeof(struct bc_umi_t));
+	for (i = 0; i < n; ++i)
+		bundle->umis[umi_beg[a[i].bc - first]++] = a[i];
+	for (c = n_cells; c > 0; --c)
+		umi_beg[c] = umi_beg[c - 1];
+	umi_beg[0] = 0;
+	free(a);
+	bundle->umi_beg = umi_beg;
+	bundle->first_cell = first;
+}
+
+static inline int is_candidate(struct bc_count_t *c, uint64_t bc, uint32_t thres)
+{
+	kmint_t k = bc_count_get(c, bc);
+	return k != KMHASH_MAX_SIZE && c->cnt[k] >= thres;
+}
+
+/*
+ * A barcode is kept if it is a candidate or one mismatch away from one in
+ * either direction: to a candidate, as enumerated by correct_dst, or from a
+ * candidate having N at that position, as enumerated by has_bigger_neighbour
+ */
+static int keep_barcode(struct bc_count_t *c, uint64_t bc, uint32_t thres)
+{
+	uint64_t tmp_idx;
+	int j, d;
+	if (is_candidate(c, bc, thres))
+		return 1;
+	for (j = 0; j < bc_len; ++j) {
+		tmp_idx = neighbour_base(bc, j, bc_len, &d);
+		for (; d < NNU; ++d)
+			if (is_candidate(c, tmp_idx ^ ((uint64_t)d << (j << 1)), thres))
+				return 1;
+		if (__enc_N_room(bc_len) && __enc_N_pos(bc, bc_len) < 0) {
+			tmp_idx = (bc & ~((uint64_t)3 << (j << 1))) | __enc_N(j);
+			if (is_candidate(c, tmp_idx, thres))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+void *select_worker(void *data)
+{
+	struct bc_bundle_t *bundle = (struct bc_bundle_t *)data;
+	struct bc_count_t *c = bundle->bc_count;
+	int i, beg, end;
+	while ((beg = __sync_fetch_and_add32(bundle->next, BC_CHUNK_SIZE)) < (int)c->size) {
+		end = __min(beg + BC_CHUNK_SIZE, (int)c->size);
+		for (i = beg; i < end; ++i)
+			if (c->keys[i] != TOMB_STONE)
+				bundle->keep[i] = keep_barcode(c, c->keys[i], bundle->cand_cnt);
+	}
+	return NULL;
+}
+
+struct bc_count_t *select_barcodes(struct bc_count_t *c, int n_threads)
+{
+	struct bc_bundle_t bundle;
+	struct bc_count_t *ret;
+	uint32_t max_cnt;
+	kmint_t i, n_keep;
+	int next;
+
+	max_cnt = 0;
+	for (i = 0; i < c->size; ++i)
+		if (c->keys[i] != TOMB_STONE)
+			max_cnt = __max(max_cnt, c->cnt[i]);
+
+	memset(&bundle, 0, sizeof(struct bc_bundle_t));
+	bundle.n_threads = n_threads;
+	bundle.next = &next;
+	bundle.bc_count = c;
+	bundle.cand_cnt = __max(CANDIDATE_THRES * max_cnt, 1);
+	bundle.keep = calloc(c->size, sizeof(uint8_t));
+	run_bc_workers(select_worker, &bundle);
+
+	n_keep = 0;
+	for (i = 0; i < c->size; ++i)
+		n_keep += bundle.keep[i];
+	ret = init_bc_count(n_keep / KMHASH_UPPER + 1);
+	for (i = 0; i < c->size; ++i)
+		if (bundle.keep[i])
+			bc_count_add(ret, c->keys[i], c->cnt[i]);
+	free(bundle.keep);
+
+	__VERBOSE("Number of barcodes kept for alignment: %u / %u\n",
+		  n_keep, c->n_items);
+	return ret;
+}
+
+static void text_reserve(struct text_buf_t *b, size_t len)
+{
+	if (b->l + len > b->m) {
+		b->m = (b->l + len) << 1;
+		b->s = realloc(b->s, b->m);
 	}
 }
 
-void print_barcodes(const char *out_dir)
+/* Write a whole text output, plain or as parallel gzip members */
+static void write_text(const char *out_dir, const char *name,
+		       struct text_buf_t *b, int gz, int n_threads)
 {
 	char out_path[MAX_PATH];
-	char *seq;
 	FILE *fp;
-	int i;
 
 	strcpy(out_path, out_dir);
-	strcat(out_path, "/barcodes.tsv");
+	strcat(out_path, "/");
+	strcat(out_path, name);
+	if (gz)
+		strcat(out_path, ".gz");
+
+	fp = xfopen(out_path, "wb");
+	if (gz)
+		gz_write_parallel(fp, b->s, b->l, n_threads);
+	else
+		xfwrite(b->s, 1, b->l, fp);
+	xwfclose(fp);
+}
 
-	fp = xfopen(out_path, "w");
+void print_barcodes(const char *out_dir, int n, int gz, int n_threads)
+{
+	struct text_buf_t b;
+	char *seq;
+	int i;
 
-	for (i = 0; i < n_bc; ++i) {
+	memset(&b, 0, sizeof(struct text_buf_t));
+	for (i = 0; i < n; ++i) {
+		text_reserve(&b, bc_len + 1);
 		seq = num2seq(CBs[i].idx, bc_len);
-		fprintf(fp, "%s\n", seq);
+		memcpy(b.s + b.l, seq, bc_len);
 		free(seq);
+		b.l += bc_len;
+		b.s[b.l++] = '\n';
 	}
 
-	fclose(fp);
+	write_text(out_dir, "barcodes.tsv", &b, gz, n_threads);
+	free(b.s);
 }
 
-void print_genes(const char *out_dir)
+/* features.tsv.gz has the feature type column of the gzipped (v3) layout */
+void print_genes(const char *out_dir, int gz, int n_threads)
 {
-	char out_path[MAX_PATH];
-	FILE *fp;
-	int i;
-
-	strcpy(out_path, out_dir);
-	strcat(out_path, "/features.tsv");
+	static const char type[] = "\tGene Expression";
+	struct text_buf_t b;
+	char *id, *name;
+	int i, l_id, l_name, l_type;
+
+	l_type = gz ? (int)sizeof(type) - 1 : 0;
+	memset(&b, 0, sizeof(struct text_buf_t));
+	for (i = 0; i < genes.n; ++i) {
+		id = genes.gene_id + genes.l_id * i;
+		name = genes.gene_name + genes.l_name * i;
+		l_id = strlen(id);
+		l_name = strlen(name);
+		text_reserve(&b, l_id + l_name + l_type + 2);
+		memcpy(b.s + b.l, id, l_id);
+		b.l += l_id;
+		b.s[b.l++] = '\t';
+		memcpy(b.s + b.l, name, l_name);
+		b.l += l_name;
+		memcpy(b.s + b.l, type, l_type);
+		b.l += l_type;
+		b.s[b.l++] = '\n';
+	}
 
-	fp = xfopen(out_path, "w");
+	write_text(out_dir, "features.tsv", &b, gz, n_threads);
+	free(b.s);
+}
 
-	for (i = 0; i < genes.n; ++i)
-		fprintf(fp, "%s\t%s\n", genes.gene_id + genes.l_id * i,
-					genes.gene_name + genes.l_name * i);
+static inline char *mtx_put_int(char *p, uint32_t x)
+{
+	char tmp[10];
+	int n = 0;
+	do {
+		tmp[n++] = '0' + x % 10;
+		x /= 10;
+	} while (x);
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
 
-	fclose(fp);
+/* Non zero if the 2-bit encoded x and y differ at exactly one base */
+static inline int is_hamming1(uint64_t x, uint64_t y)
+{
+	uint64_t d = x ^ y;
+	d = (d | d >> 1) & UINT64_C(0x5555555555555555);
+	return d && !(d & (d - 1));
 }
 
-void write_mtx(const char *bin_path, const char *out_dir)
+static void umi_engine_reserve(struct umi_engine_t *g, size_t n)
 {
-	char out_path[MAX_PATH];
-	FILE *fbin, *fmtx;
-	strcpy(out_path, out_dir);
-	strcat(out_path, "/matrix.mtx");
-	fbin = xfopen(bin_path, "rb");
-	fmtx = xfopen(out_path, "wb");
-	int m, n, r, c, cnt;
-	uint64_t k, i;
-	xfread(&n, sizeof(int), 1, fbin);
-	xfread(&m, sizeof(int), 1, fbin);
-	xfread(&k, sizeof(uint64_t), 1, fbin);
-	fprintf(fmtx, "%%%%MatrixMarket matrix coordinate integer general\n");
-	fprintf(fmtx, "%%Gene count matrix generated by hera-T version %d.%d.%d\n",
-		PROG_VERSION_MAJOR, PROG_VERSION_MINOR, PROG_VERSION_FIX);
-	fprintf(fmtx, "%d\t%d\t%llu\n", n, m, (unsigned long long)k);
-	for (i = 0; i < k; ++i) {
-		xfread(&r, sizeof(int), 1, fbin);
-		xfread(&c, sizeof(int), 1, fbin);
-		xfread(&cnt, sizeof(int), 1, fbin);
-		fprintf(fmtx, "%d\t%d\t%d\n", r, c, cnt);
-	}
-	fclose(fbin);
-	xwfclose(fmtx);
-}
-
-void correct_umi(struct sc_cell_t *bc)
+	if (n <= g->m)
+		return;
+	g->m = n;
+	g->rec = realloc(g->rec, n * sizeof(struct umi_rec_t));
+	g->tmp = realloc(g->tmp, n * sizeof(uint64_t));
+	g->eoff = realloc(g->eoff, (n + 1) * sizeof(uint32_t));
+	g->queue = realloc(g->queue, n * sizeof(uint32_t));
+	g->visited = realloc(g->visited, n);
+}
+
+static void umi_engine_destroy(struct umi_engine_t *g)
 {
-	struct umi_hash_t *h;
-	kmint_t i, iter;
-	uint64_t umi_idx, new_umi, new_bin;
-	int gene, has_Ns, k, ch, c, flag;
-	h = bc->h;
+	free(g->rec);
+	free(g->tmp);
+	free(g->eoff);
+	free(g->queue);
+	free(g->visited);
+	free(g->edge);
+}
 
-	for (i = 0; i < h->size; ++i) {
-		if (h->bucks[i] == TOMB_STONE || __get_gene(h->bucks[i]) == genes.n)
-			continue;
-		umi_idx = __get_umi(h->bucks[i]);
-		gene = __get_gene(h->bucks[i]);
-		has_Ns = 0;
+/* Directional edges between neighbours a and b: a absorbs b if it has at
+ * least twice as many reads minus one */
+static inline void link_umis(struct umi_engine_t *g, struct umi_rec_t *r,
+			     uint32_t a, uint32_t b)
+{
+	if (g->n_edges + 2 > g->m_edges) {
+		g->m_edges = __max(g->m_edges << 1, 64);
+		g->edge = realloc(g->edge, g->m_edges * sizeof(uint64_t));
+	}
+	if ((uint64_t)r[a].cnt + 1 >= 2 * (uint64_t)r[b].cnt)
+		g->edge[g->n_edges++] = (uint64_t)a << 32 | b;
+	if ((uint64_t)r[b].cnt + 1 >= 2 * (uint64_t)r[a].cnt)
+		g->edge[g->n_edges++] = (uint64_t)b << 32 | a;
+}
 
-		for (k = 0; k < umi_len; ++k) {
-			ch = (umi_idx / pow5_r[k]) % 5;
-			has_Ns += (ch == NNU);
+/*
+ * UMIs r[0, n) of one gene sorted by key. Two UMIs one mismatch apart share
+ * either the bits above lo_bits, then they are next to each other in r, or
+ * the lo_bits, then they are next to each other once sorted by them. From
+ * the UMI with the most reads down, each one not yet clustered takes all
+ * the UMIs it reaches through the edges, these are marked as removed
+ */
+static void cluster_gene(struct umi_engine_t *g, struct umi_hash_t *h,
+			 struct umi_rec_t *r, uint32_t n, int lo_bits)
+{
+	uint64_t mask;
+	uint32_t i, j, a, b, u, v, k, qh, qt;
+	size_t e;
+
+	g->n_edges = 0;
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && r[j].key >> lo_bits == r[i].key >> lo_bits; ++j);
+		for (a = i; a < j; ++a)
+			for (b = a + 1; b < j; ++b)
+				if (is_hamming1(r[a].key, r[b].key))
+					link_umis(g, r, a, b);
+	}
+	mask = ((uint64_t)1 << lo_bits) - 1;
+	for (i = 0; i < n; ++i)
+		g->tmp[i] = (r[i].key & mask) << 32 | i;
+	rs_sort(umi, g->tmp, g->tmp + n);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && g->tmp[j] >> 32 == g->tmp[i] >> 32; ++j);
+		for (a = i; a < j; ++a) {
+			for (b = a + 1; b < j; ++b) {
+				u = (uint32_t)g->tmp[a];
+				v = (uint32_t)g->tmp[b];
+				if (is_hamming1(r[u].key, r[v].key))
+					link_umis(g, r, u, v);
+			}
 		}
-
-		if (has_Ns) {
-			h->bucks[i] = h->bucks[i] >> GENE_BIT_LEN << GENE_BIT_LEN | genes.n;
+	}
+	if (!g->n_edges)
+		return;
+
+	rs_sort(umi, g->edge, g->edge + g->n_edges);
+	memset(g->eoff, 0, (n + 1) * sizeof(uint32_t));
+	for (e = 0; e < g->n_edges; ++e)
+		++g->eoff[(g->edge[e] >> 32) + 1];
+	for (i = 0; i < n; ++i)
+		g->eoff[i + 1] += g->eoff[i];
+
+	for (i = 0; i < n; ++i)
+		g->tmp[i] = (uint64_t)(~r[i].cnt) << 32 | i;
+	rs_sort(umi, g->tmp, g->tmp + n);
+	memset(g->visited, 0, n);
+	for (k = 0; k < n; ++k) {
+		u = (uint32_t)g->tmp[k];
+		if (g->visited[u])
 			continue;
-		}
-		flag = 0;
-
-		for (k = 0; k < umi_len; ++k) {
-			ch = (umi_idx / pow5_r[k]) % 5;
-			for (c = 0; c < NNU; ++c) {
-				if (c == ch)
+		g->visited[u] = 1;
+		qh = qt = 0;
+		g->queue[qt++] = u;
+		while (qh < qt) {
+			u = g->queue[qh++];
+			for (e = g->eoff[u]; e < g->eoff[u + 1]; ++e) {
+				v = (uint32_t)g->edge[e];
+				if (g->visited[v])
 					continue;
-				new_umi = umi_idx + (c - ch) * pow5_r[k];
-				new_bin = (new_umi << GENE_BIT_LEN | gene);
-				iter = umihash_get(h, new_bin);
-				if (iter != KMHASH_MAX_SIZE) {
-					h->bucks[i] = h->bucks[i] >> GENE_BIT_LEN << GENE_BIT_LEN | genes.n;
-					flag = 1;
-					break;
-				}
+				g->visited[v] = 1;
+				g->queue[qt++] = v;
+				h->bucks[r[v].pos] = h->bucks[r[v].pos] >> GENE_BIT_LEN
+							<< GENE_BIT_LEN | genes.n;
 			}
-			if (flag)
-				break;
 		}
 	}
 }
 
-void count_genes(struct sc_cell_t *bc, int bc_pos, int *cnt, FILE *fbin,
-		 pthread_mutex_t *lock, uint64_t *n_lines)
+/* UMIs are clustered gene by gene, those with N came in removed */
+void correct_umi(struct sc_cell_t *bc, struct umi_engine_t *g)
 {
-	kmint_t i;
-	int k;
 	struct umi_hash_t *h;
+	struct umi_rec_t *r;
+	uint32_t *cnt, n, i, j;
+	uint64_t umi_idx;
+	kmint_t k;
+
 	h = bc->h;
+	cnt = __umihash_cnt(h);
+	umi_engine_reserve(g, h->n_items);
+	r = g->rec;
+	n = 0;
+	for (k = 0; k < h->size; ++k) {
+		if (h->bucks[k] == TOMB_STONE || __get_gene(h->bucks[k]) == genes.n)
+			continue;
+		umi_idx = __get_umi(h->bucks[k]);
+		r[n].key = (uint64_t)__get_gene(h->bucks[k]) << UMI_KEY_BITS | umi_idx;
+		r[n].cnt = cnt[k];
+		r[n++].pos = k;
+	}
+	rs_sort(umi_rec, r, r + n);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && __rec_gene(r[j].key) == __rec_gene(r[i].key); ++j);
+		if (j - i > 1)
+			cluster_gene(g, h, r + i, j - i, umi_len & ~1);
+	}
+}
 
-	memset(cnt, 0, genes.n * sizeof(int));
+/* Genes of the cell's UMIs sorted and run-length counted into blk, buf
+ * holds bc->h->n_items entries. Returns the number of entries */
+int count_genes(struct sc_cell_t *bc, uint32_t *buf, struct cell_block_t *blk)
+{
+	kmint_t i, n, j;
+	int n_genes;
+	struct umi_hash_t *h;
+	h = bc->h;
+
+	n = 0;
 	for (i = 0; i < h->size; ++i) {
 		if (h->bucks[i] == TOMB_STONE || __get_gene(h->bucks[i]) == genes.n)
 			continue;
-		++cnt[__get_gene(h->bucks[i])];
+		buf[n++] = __get_gene(h->bucks[i]);
 	}
+	rs_sort(gene, buf, buf + n);
 
-	pthread_mutex_lock(lock);
-	for (k = 1; k <= genes.n; ++k) {
-		if (cnt[k - 1]) {
-			++*n_lines;
-			xfwrite(&k, sizeof(int), 1, fbin);
-			xfwrite(&bc_pos, sizeof(int), 1, fbin);
-			xfwrite(cnt + (k - 1), sizeof(int), 1, fbin);
-		}
+	if (blk->l + n > blk->m) {
+		blk->m = (blk->l + n) << 1;
+		blk->gene = realloc(blk->gene, blk->m * sizeof(uint32_t));
+		blk->cnt = realloc(blk->cnt, blk->m * sizeof(uint32_t));
 	}
-	pthread_mutex_unlock(lock);
+	n_genes = 0;
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && buf[j] == buf[i]; ++j);
+		blk->gene[blk->l] = buf[i];
+		blk->cnt[blk->l++] = j - i;
+		++n_genes;
+	}
+	return n_genes;
 }
 
-void *umi_worker(void *data)
+/* Matrix market lines of the block of cells [beg, end), returns the length
+ * of the lines of cells before mid */
+static size_t format_mtx_block(struct cell_block_t *blk, int beg, int end,
+			       int mid, struct text_buf_t *out)
 {
-	struct umi_bundle_t *bundle = (struct umi_bundle_t *)data;
-	int i, n_threads, thread_no;
-	FILE *fbin;
-	pthread_mutex_t *lock;
-	uint64_t *n_lines;
-	int *cnt;
+	size_t k, l_mid;
+	int i, j;
+	char *p;
+
+	/* at most 3 * 10 digits, 2 tabs and a newline per entry */
+	out->l = 0;
+	text_reserve(out, blk->l * 33);
+	p = out->s;
+	l_mid = 0;
+	k = 0;
+	for (i = beg; i < end; ++i) {
+		if (i == mid)
+			l_mid = p - out->s;
+		for (j = 0; j < blk->n[i - beg]; ++j, ++k) {
+			p = mtx_put_int(p, blk->gene[k] + 1);
+			*p++ = '\t';
+			p = mtx_put_int(p, i + 1);
+			*p++ = '\t';
+			p = mtx_put_int(p, blk->cnt[k]);
+			*p++ = '\n';
+		}
+	}
+	out->l = p - out->s;
+	return mid < end ? l_mid : out->l;
+}
 
-	cnt = malloc(genes.n * sizeof(int));
-	n_threads = bundle->n_threads;
-	thread_no = bundle->thread_no;
-	fbin = bundle->fbin;
-	lock = bundle->lock;
-	n_lines = bundle->n_lines;
+static void csc_seek(FILE *fp, uint64_t pos)
+{
+#if defined(_MSC_VER)
+	if (_fseeki64(fp, (__int64)pos, SEEK_SET))
+#else
+	if (fseeko(fp, (off_t)pos, SEEK_SET))
+#endif
+		__ERROR("Unable to seek in matrix.csc");
+}
 
-	for (i = 0; i < n_bc; ++i) {
-		if (i % n_threads == thread_no) {
-			correct_umi(CBs + i);
-			count_genes(CBs + i, i + 1, cnt, fbin, lock, n_lines);
+/* n values of w (4 or 8) bytes each, as little-endian whatever the host */
+static void csc_write_le(FILE *fp, const void *a, int w, size_t n)
+{
+	unsigned char buf[4096];
+	uint64_t x;
+	size_t i, k;
+	int b;
+
+	for (i = k = 0; i < n; ++i) {
+		x = w == 4 ? ((const uint32_t *)a)[i] : ((const uint64_t *)a)[i];
+		for (b = 0; b < w; ++b, x >>= 8)
+			buf[k++] = (unsigned char)x;
+		if (k == sizeof(buf)) {
+			xfwrite(buf, 1, k, fp);
+			k = 0;
 		}
 	}
+	if (k)
+		xfwrite(buf, 1, k, fp);
+}
 
-	free(cnt);
-	pthread_exit(NULL);
+static uint64_t csc_write_strings(FILE *fp, uint64_t pos, int n,
+				  const char *s, int l_s)
+{
+	uint64_t *off;
+	int i;
+
+	off = malloc((n + 1) * sizeof(uint64_t));
+	off[0] = 0;
+	for (i = 0; i < n; ++i)
+		off[i + 1] = off[i] + strlen(s + (size_t)l_s * i);
+	csc_seek(fp, pos);
+	csc_write_le(fp, off, sizeof(uint64_t), n + 1);
+	for (i = 0; i < n; ++i)
+		xfwrite((void *)(s + (size_t)l_s * i), 1, off[i + 1] - off[i], fp);
+	pos = __csc_align(pos + (n + 1) * sizeof(uint64_t) + off[n]);
+	free(off);
+	return pos;
 }
 
-void quantification(struct opt_count_t *opt, struct kmhash_t *h)
+/* Everything but the matrix entries is known before counting */
+static void csc_open(struct csc_writer_t *w, const char *out_dir, int n)
 {
-	cut_off_barcode(h);
-	__VERBOSE("Done cutting off barcode\n");
-	correct_barcode(h);
-	__VERBOSE("Done processing barcode\n");
+	char out_path[MAX_PATH];
+	uint64_t pos, zero;
+	char *seqs, *seq;
+	int i;
 
-	print_barcodes(opt->out_dir);
-	print_genes(opt->out_dir);
+	strcpy(out_path, out_dir);
+	strcat(out_path, "/matrix.csc");
+	w->fp = xfopen(out_path, "wb");
+	strcpy(w->data_path, out_path);
+	strcat(w->data_path, ".data.tmp");
+	w->fdata = xfopen(w->data_path, "wb");
+	w->nnz = 0;
+
+	memset(&w->hdr, 0, sizeof(struct csc_header_t));
+	memcpy(w->hdr.magic, "HERACSC", 8);
+	w->hdr.version = CSC_VERSION;
+	w->hdr.align = CSC_ALIGN;
+	w->hdr.n_genes = genes.n;
+	w->hdr.n_cells = n;
+
+	seqs = malloc((size_t)n * (bc_len + 1));
+	for (i = 0; i < n; ++i) {
+		seq = num2seq(CBs[i].idx, bc_len);
+		memcpy(seqs + (size_t)i * (bc_len + 1), seq, bc_len + 1);
+		free(seq);
+	}
+	pos = CSC_ALIGN;
+	w->hdr.barcodes = pos;
+	pos = csc_write_strings(w->fp, pos, n, seqs, bc_len + 1);
+	w->hdr.feature_ids = pos;
+	pos = csc_write_strings(w->fp, pos, genes.n, genes.gene_id, genes.l_id);
+	w->hdr.feature_names = pos;
+	pos = csc_write_strings(w->fp, pos, genes.n, genes.gene_name, genes.l_name);
+	free(seqs);
+
+	w->hdr.indptr = pos;
+	w->hdr.indices = __csc_align(pos + ((uint64_t)n + 1) * sizeof(uint64_t));
+	zero = 0;
+	csc_seek(w->fp, w->hdr.indptr);
+	csc_write_le(w->fp, &zero, sizeof(uint64_t), 1);
+}
+
+/* Called in block order with the cells [beg, end) of the block */
+static void csc_write_block(struct csc_writer_t *w, struct cell_block_t *blk,
+			    int beg, int end)
+{
+	uint64_t indptr[MTX_BLOCK_SIZE], nnz;
+	int i;
+
+	nnz = w->nnz;
+	for (i = beg; i < end; ++i) {
+		nnz += blk->n[i - beg];
+		indptr[i - beg] = nnz;
+	}
+	csc_seek(w->fp, w->hdr.indptr + ((uint64_t)beg + 1) * sizeof(uint64_t));
+	csc_write_le(w->fp, indptr, sizeof(uint64_t), end - beg);
+	csc_seek(w->fp, w->hdr.indices + w->nnz * sizeof(uint32_t));
+	csc_write_le(w->fp, blk->gene, sizeof(uint32_t), nnz - w->nnz);
+	csc_write_le(w->fdata, blk->cnt, sizeof(uint32_t), nnz - w->nnz);
+	w->nnz = nnz;
+}
 
+/* The header is written field by field in the order of csc_header_t */
+static void csc_close(struct csc_writer_t *w)
+{
+	uint64_t f[9];
+	uint32_t v[2];
+	char *buf;
+	size_t n;
+
+	xwfclose(w->fdata);
+	w->hdr.nnz = w->nnz;
+	w->hdr.data = __csc_align(w->hdr.indices + w->nnz * sizeof(uint32_t));
+
+	buf = malloc(CSC_COPY_SIZE);
+	w->fdata = xfopen(w->data_path, "rb");
+	csc_seek(w->fp, w->hdr.data);
+	while ((n = fread(buf, 1, CSC_COPY_SIZE, w->fdata)) > 0)
+		xfwrite(buf, 1, n, w->fp);
+	fclose(w->fdata);
+	remove(w->data_path);
+	free(buf);
+
+	v[0] = w->hdr.version;
+	v[1] = w->hdr.align;
+	f[0] = w->hdr.n_genes;
+	f[1] = w->hdr.n_cells;
+	f[2] = w->hdr.nnz;
+	f[3] = w->hdr.indptr;
+	f[4] = w->hdr.indices;
+	f[5] = w->hdr.data;
+	f[6] = w->hdr.barcodes;
+	f[7] = w->hdr.feature_ids;
+	f[8] = w->hdr.feature_names;
+	csc_seek(w->fp, 0);
+	xfwrite(w->hdr.magic, 1, sizeof(w->hdr.magic), w->fp);
+	csc_write_le(w->fp, v, sizeof(uint32_t), 2);
+	csc_write_le(w->fp, f, sizeof(uint64_t), 9);
+	xwfclose(w->fp);
+}
+
+/* Spilled UMIs of a cell are sorted so that its hash does not depend on
+ * the order of the runs */
+static void hash_cell_umis(struct umi_bundle_t *bundle, int i)
+{
+	struct bc_umi_t *b, *e;
+	b = bundle->umis + bundle->umi_beg[i - bundle->first_cell];
+	e = bundle->umis + bundle->umi_beg[i - bundle->first_cell + 1];
+	rs_sort(cell_umi, b, e);
+	CBs[i].h = umihash_build(b, e - b, CBs[i].idx);
+}
+
+/*
+ * Chunks of cells are taken in order and counted into a thread-local
+ * buffer, each chunk is appended to the outputs once all the chunks before
+ * it are written. Cells are a prefix of the raw barcodes, so a chunk of the
+ * filtered matrix is a prefix of the same chunk of the raw one
+ */
+void *umi_worker(void *data)
+{
+	struct umi_bundle_t *bundle = (struct umi_bundle_t *)data;
+	struct mtx_out_t *o, *last;
+	struct text_buf_t out, zout, zmid;
+	struct cell_block_t blk;
+	struct umi_engine_t engine;
+	int i, k, c, beg, end, o_end, gz;
+	size_t l_mid;
+	uint32_t *buf;
+	kmint_t m;
+
+	m = 0;
+	buf = NULL;
+	memset(&out, 0, sizeof(struct text_buf_t));
+	memset(&zout, 0, sizeof(struct text_buf_t));
+	memset(&zmid, 0, sizeof(struct text_buf_t));
+	memset(&blk, 0, sizeof(struct cell_block_t));
+	memset(&engine, 0, sizeof(struct umi_engine_t));
+	last = bundle->outs + bundle->n_outs - 1;
+	gz = last->gz;
+
+	while ((c = __sync_fetch_and_add32(bundle->next_chunk, 1)) < bundle->n_chunks) {
+		beg = bundle->chunk[c];
+		end = bundle->chunk[c + 1];
+		blk.l = 0;
+		for (i = beg; i < end; ++i) {
+			if (bundle->umis)
+				hash_cell_umis(bundle, i);
+			correct_umi(CBs + i, &engine);
+			if (CBs[i].h->n_items > m) {
+				m = CBs[i].h->n_items;
+				buf = realloc(buf, m * sizeof(uint32_t));
+			}
+			blk.n[i - beg] = count_genes(CBs + i, buf, &blk);
+			if (bundle->umis) {
+				umihash_destroy(CBs[i].h);
+				CBs[i].h = NULL;
+			}
+		}
+		l_mid = format_mtx_block(&blk, beg, end, n_bc, &out);
+		if (gz) {
+			zout.l = zmid.l = 0;
+			gz_member(out.s, out.l, Z_DEFAULT_COMPRESSION,
+				  &zout.s, &zout.l, &zout.m);
+			if (beg < n_bc && n_bc < end)
+				gz_member(out.s, l_mid, Z_DEFAULT_COMPRESSION,
+					  &zmid.s, &zmid.l, &zmid.m);
+		}
+
+		while (*bundle->n_written != c)
+			__thread_yield();
+		__sync_full_barrier();
+		for (o = bundle->outs; o <= last; ++o) {
+			o_end = __min(end, o->n_cells);
+			if (o_end <= beg)
+				continue;
+			if (o_end == end && gz)
+				xfwrite(zout.s, 1, zout.l, o->fmtx);
+			else if (o_end == end)
+				xfwrite(out.s, 1, out.l, o->fmtx);
+			else if (gz)
+				xfwrite(zmid.s, 1, zmid.l, o->fmtx);
+			else
+				xfwrite(out.s, 1, l_mid, o->fmtx);
+			if (o->csc)
+				csc_write_block(o->csc, &blk, beg, o_end);
+			for (k = 0; k < o_end - beg; ++k)
+				o->n_lines += blk.n[k];
+		}
+		__sync_fetch_and_add32(bundle->n_written, 1);
+	}
+
+	free(out.s);
+	free(zout.s);
+	free(zmid.s);
+	free(blk.gene);
+	free(blk.cnt);
+	free(buf);
+	umi_engine_destroy(&engine);
+	return NULL;
+}
+
+/* Barcodes, features and the matrix header with room for nnz */
+static void mtx_open(struct mtx_out_t *o, const char *out_dir, int n_cells,
+		     struct opt_count_t *opt)
+{
 	char out_path[MAX_PATH];
-	strcpy(out_path, opt->out_dir);
-	strcat(out_path, "/matrix.bin");
 
-	FILE *fbin;
-	fbin = xfopen(out_path, "wb");
+	memset(o, 0, sizeof(struct mtx_out_t));
+	o->n_cells = n_cells;
+	o->gz = opt->gzip_out;
 
-	xfwrite(&genes.n, sizeof(int), 1, fbin);
-	xfwrite(&n_bc, sizeof(int), 1, fbin);
+	print_barcodes(out_dir, n_cells, o->gz, opt->n_threads);
+	print_genes(out_dir, o->gz, opt->n_threads);
 
-	uint64_t n_lines = 0;
-	xfwrite(&n_lines, sizeof(uint64_t), 1, fbin);
+	strcpy(out_path, out_dir);
+	strcat(out_path, o->gz ? "/matrix.mtx.gz" : "/matrix.mtx");
+	o->fmtx = xfopen(out_path, "wb");
+	text_reserve(&o->hdr, 256);
+	o->hdr.l = sprintf(o->hdr.s, "%%%%MatrixMarket matrix coordinate integer general\n"
+			   "%%Gene count matrix generated by hera-T version %d.%d.%d\n"
+			   "%d\t%d\t", PROG_VERSION_MAJOR, PROG_VERSION_MINOR,
+			   PROG_VERSION_FIX, genes.n, n_cells);
+	o->nnz_pos = o->hdr.l;
+	o->hdr.l += sprintf(o->hdr.s + o->hdr.l, "%*s\n", MTX_NNZ_WIDTH, "");
+	/* a stored gzip member has the same size whatever nnz is */
+	if (o->gz) {
+		gz_member(o->hdr.s, o->hdr.l, Z_NO_COMPRESSION,
+			  &o->zhdr.s, &o->zhdr.l, &o->zhdr.m);
+		o->zhdr_len = o->zhdr.l;
+		xfwrite(o->zhdr.s, 1, o->zhdr.l, o->fmtx);
+	} else {
+		xfwrite(o->hdr.s, 1, o->hdr.l, o->fmtx);
+	}
 
-	pthread_attr_t attr;
-	pthread_t *t;
-	pthread_mutex_t *lock;
-	struct umi_bundle_t *bundles;
+	if (opt->csc_out) {
+		o->csc = malloc(sizeof(struct csc_writer_t));
+		csc_open(o->csc, out_dir, n_cells);
+	}
+}
 
-	pthread_attr_init(&attr);
-	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+static void mtx_close(struct mtx_out_t *o)
+{
+	sprintf(o->hdr.s + o->nnz_pos, "%-*llu", MTX_NNZ_WIDTH,
+		(unsigned long long)o->n_lines);
+	o->hdr.s[o->hdr.l - 1] = '\n';
+	if (o->gz) {
+		o->zhdr.l = 0;
+		gz_member(o->hdr.s, o->hdr.l, Z_NO_COMPRESSION,
+			  &o->zhdr.s, &o->zhdr.l, &o->zhdr.m);
+		assert(o->zhdr.l == o->zhdr_len);
+		fseek(o->fmtx, 0, SEEK_SET);
+		xfwrite(o->zhdr.s, 1, o->zhdr.l, o->fmtx);
+	} else {
+		fseek(o->fmtx, o->nnz_pos, SEEK_SET);
+		xfwrite(o->hdr.s + o->nnz_pos, 1, MTX_NNZ_WIDTH, o->fmtx);
+	}
+	xwfclose(o->fmtx);
+	free(o->hdr.s);
+	free(o->zhdr.s);
 
-	lock = calloc(1, sizeof(pthread_mutex_t));
-	pthread_mutex_init(lock, NULL);
+	if (o->csc) {
+		csc_close(o->csc);
+		free(o->csc);
+	}
+}
 
-	t = calloc(opt->n_threads, sizeof(pthread_t));
-	bundles = calloc(opt->n_threads, sizeof(struct umi_bundle_t));
+/*
+ * Cells [beg, end) cut into chunks of about the same number of UMIs, so the
+ * big cells at the front are spread over the threads as well as the many
+ * small ones at the back. A chunk never crosses a block boundary
+ */
+static void plan_umi_chunks(struct umi_bundle_t *bundle, int beg, int end)
+{
+	uint64_t total, target, w;
+	int i, n;
+
+	total = 0;
+	for (i = beg; i < end; ++i)
+		total += CBs[i].cnt_umi + 1;
+	target = __max(total / ((uint64_t)bundle->n_threads * UMI_CHUNKS_PER_THREAD), 1);
+
+	bundle->chunk = realloc(bundle->chunk, (end - beg + 1) * sizeof(int));
+	n = 0;
+	w = 0;
+	for (i = beg; i < end; ++i) {
+		if (i == beg || w >= target || i % MTX_BLOCK_SIZE == 0) {
+			bundle->chunk[n++] = i;
+			w = 0;
+		}
+		w += CBs[i].cnt_umi + 1;
+	}
+	bundle->chunk[n] = end;
+	bundle->n_chunks = n;
+	*bundle->next_chunk = 0;
+	*bundle->n_written = 0;
+}
 
+static void run_umi_workers(struct umi_bundle_t *proto)
+{
+	struct umi_bundle_t *bundles;
 	int i;
-	for (i = 0; i < opt->n_threads; ++i) {
-		bundles[i].lock = lock;
-		bundles[i].fbin = fbin;
+
+	bundles = calloc(proto->n_threads, sizeof(struct umi_bundle_t));
+	for (i = 0; i < proto->n_threads; ++i) {
+		bundles[i] = *proto;
 		bundles[i].thread_no = i;
-		bundles[i].n_threads = opt->n_threads;
-		bundles[i].n_lines = &n_lines;
-		pthread_create(t + i, &attr, umi_worker, bundles + i);
 	}
+	thread_pool_run(umi_worker, bundles, sizeof(struct umi_bundle_t),
+			proto->n_threads);
+	free(bundles);
+}
+
+/*
+ * With a spill, the UMIs of the barcodes are on disk and h only has their
+ * number. Cells are then counted by ranges of blocks whose UMIs fit in the
+ * memory limit
+ */
+void quantification(struct opt_count_t *opt, struct kmhash_t *h,
+		    struct bc_spill_t *sp)
+{
+	int n_raw;
 
-	for (i = 0; i < opt->n_threads; ++i)
-		pthread_join(t[i], NULL);
+	cut_off_barcode(h, opt->n_threads);
+	__VERBOSE("Done cutting off barcode\n");
+	correct_barcode(h, opt->n_threads);
+	__VERBOSE("Done processing barcode\n");
 
-	fseek(fbin, 8L, SEEK_SET);
-	xfwrite(&n_lines, sizeof(uint64_t), 1, fbin);
-	xwfclose(fbin);
+	struct mtx_out_t outs[2];
+	char raw_dir[MAX_PATH];
+	int n_outs = 1;
+
+	mtx_open(outs, opt->out_dir, n_bc, opt);
+	if (opt->raw_out) {
+		n_raw = collect_raw_barcodes(h->n_items, opt->n_threads);
+		strcpy(raw_dir, opt->out_dir);
+		strcat(raw_dir, "/raw");
+		make_dir(raw_dir);
+		mtx_open(outs + 1, raw_dir, n_raw, opt);
+		n_outs = 2;
+	}
 
-	write_mtx(out_path, opt->out_dir);
+	struct umi_bundle_t bundle;
+	struct bc_spill_t *cells;
+	int next_chunk, n_cols, n_blocks, beg, end, i;
+	volatile int n_written = 0;
+	size_t n, l, max_umis;
+
+	memset(&bundle, 0, sizeof(struct umi_bundle_t));
+	bundle.n_threads = opt->n_threads;
+	bundle.next_chunk = &next_chunk;
+	bundle.n_written = &n_written;
+	bundle.outs = outs;
+	bundle.n_outs = n_outs;
+	n_cols = outs[n_outs - 1].n_cells;
+	n_blocks = (n_cols + MTX_BLOCK_SIZE - 1) / MTX_BLOCK_SIZE;
+
+	if (!sp) {
+		plan_umi_chunks(&bundle, 0, n_cols);
+		run_umi_workers(&bundle);
+	} else {
+		cells = spill_cells(h, sp, n_cols, opt);
+		max_umis = opt->mem_limit / SPILL_UMI_BYTES;
+		for (beg = 0; beg < n_blocks; beg = end) {
+			n = bc_spill_size(cells, beg, beg + 1);
+			for (end = beg + 1; end < n_blocks; ++end) {
+				l = bc_spill_size(cells, end, end + 1);
+				if (n + l > max_umis)
+					break;
+				n += l;
+			}
+			load_cell_range(cells, beg, end, n_cols, &bundle);
+			plan_umi_chunks(&bundle, beg * MTX_BLOCK_SIZE,
+					__min(end * MTX_BLOCK_SIZE, n_cols));
+			run_umi_workers(&bundle);
+			free(bundle.umis);
+			free(bundle.umi_beg);
+		}
+		bc_spill_destroy(cells);
+	}
 
-	free(t);
-	free(bundles);
+	free(bundle.chunk);
+	for (i = 0; i < n_outs; ++i)
+		mtx_close(outs + i);
 }
@@ -7,6 +7,14 @@
 
 void init_barcode(struct gene_info_t *g, struct library_t lib);
 
-void quantification(struct opt_count_t *opt, struct kmhash_t *h);
+/* Barcode key of seq, TOMB_STONE if the barcode can not be kept */
+uint64_t barcode2num(const char *seq, int len);
+
+/* barcodes whose UMIs are kept when the read 1 counts are known */
+struct bc_count_t *select_barcodes(struct bc_count_t *c, int n_threads);
+
+/* sp holds the UMIs when they were spilled to disk, NULL otherwise */
+void quantification(struct opt_count_t *opt, struct kmhash_t *h,
+		    struct bc_spill_t *sp);
 
 #endif
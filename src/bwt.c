@@ -86,6 +86,60 @@ void bwt_2occ(struct bwt_t *bwt, bioint_t l, bioint_t r, uint8_t c, bioint_t *o_
 	}
 }
 
+static inline void bwt_prefetch_occ(struct bwt_t *bwt, bioint_t k)
+{
+	if (k >= bwt->seq_len) // also (bioint_t)(-1)
+		return;
+	k -= (k >= bwt->primary);
+	__prefetch(bwt_occ_intv(bwt->bwt, k));
+}
+
+void bwt_backward_batch(struct bwt_t *bwt, struct bwt_search_t *q, int n)
+{
+	/* Extend up to BWT_BATCH_SIZE independent searches in lockstep: issue
+	 * prefetches for the occ blocks of every search first, then do the
+	 * actual occ counting. Each search stops at the first N, at the begin
+	 * of its sequence or right before its interval becomes empty.
+	 */
+	struct bwt_search_t *p;
+	bioint_t o_l, o_r;
+	int act[BWT_BATCH_SIZE];
+	int b, i, n_act;
+	uint8_t c;
+	for (b = 0; b < n; b += BWT_BATCH_SIZE) {
+		n_act = 0;
+		for (i = b; i < n && i < b + BWT_BATCH_SIZE; ++i)
+			act[n_act++] = i;
+		while (n_act) {
+			for (i = 0; i < n_act;) {
+				p = q + act[i];
+				if (p->pos < 0 || nt4_table[(int)p->seq[p->pos]] > 3) {
+					act[i] = act[--n_act];
+					continue;
+				}
+				bwt_prefetch_occ(bwt, p->l - 1);
+				bwt_prefetch_occ(bwt, p->r);
+				++i;
+			}
+			for (i = 0; i < n_act;) {
+				p = q + act[i];
+				c = nt4_table[(int)p->seq[p->pos]];
+				bwt_2occ(bwt, p->l - 1, p->r, c, &o_l, &o_r);
+				o_l = bwt->CC[c] + o_l + 1;
+				o_r = bwt->CC[c] + o_r;
+				if (o_l > o_r) {
+					act[i] = act[--n_act];
+					continue;
+				}
+				p->l = o_l;
+				p->r = o_r;
+				--p->pos;
+				++i;
+			}
+		}
+	}
+}
+
 static inline bioint_t bwt_invPsi(struct bwt_t *bwt, bioint_t k) // compute inverse CSA
 {
 	bioint_t x = k - (k > bwt->primary);
@@ -94,19 +148,21 @@ static inline bioint_t bwt_invPsi(struct bwt_t *bwt, bioint_t k) // compute inve
 	return k == bwt->primary ? 0 : x;
 }
 
-void bwt_cal_sa(struct bwt_t *bwt)
+void bwt_cal_sa(struct bwt_t *bwt, int sa_shift)
 {
-	bioint_t i, isa, sa;
-	bwt->n_sa = (bwt->seq_len + SA_INTV) / SA_INTV;
+	bioint_t i, isa, sa, mask;
+	bwt->sa_shift = sa_shift;
+	mask = ((bioint_t)1 << sa_shift) - 1;
+	bwt->n_sa = (bwt->seq_len >> sa_shift) + 1;
 	bwt->sa = (bioint_t *)calloc(bwt->n_sa, sizeof(bioint_t));
 
 	isa = 0; sa = bwt->seq_len;
 	for (i = 0; i < bwt->seq_len; ++i) {
-		if (isa % SA_INTV == 0) bwt->sa[isa / SA_INTV] = sa;
+		if ((isa & mask) == 0) bwt->sa[isa >> sa_shift] = sa;
 		--sa;
 		isa = bwt_invPsi(bwt, isa);
 	}
-	if (isa % SA_INTV == 0) bwt->sa[isa / SA_INTV] = sa;
+	if ((isa & mask) == 0) bwt->sa[isa >> sa_shift] = sa;
 	bwt->sa[0] = (bioint_t)(-1);
 }
 
@@ -157,12 +213,13 @@ void bwt_construct(struct bwt_t *bwt)
 
 bioint_t bwt_sa(struct bwt_t *bwt, bioint_t k)
 {
-	bioint_t sa = 0;
-	while (k & SA_INTV_MASK) {
+	bioint_t sa = 0, mask;
+	mask = ((bioint_t)1 << bwt->sa_shift) - 1;
+	while (k & mask) {
 		++sa;
 		k = bwt_invPsi(bwt, k);
 	}
-	return sa + bwt->sa[k / SA_INTV];
+	return sa + bwt->sa[k >> bwt->sa_shift];
 }
 
 bioint_t bwt_match_exact(struct bwt_t *bwt, const char *str, int len, bioint_t *sa_beg, bioint_t *sa_end)
@@ -186,6 +243,58 @@ bioint_t bwt_match_exact(struct bwt_t *bwt, const char *str, int len, bioint_t *
 	return (r - l + 1);
 }
 
+static void lut_extend(struct bwt_t *bwt, int d, uint64_t idx, bioint_t l, bioint_t r)
+{
+	bioint_t o_l, o_r, n_l, n_r;
+	uint8_t c;
+	if (d == bwt->lut_k) {
+		bwt->lut[idx << 1] = l;
+		bwt->lut[idx << 1 | 1] = r;
+		return;
+	}
+	for (c = 0; c < 4; ++c) {
+		bwt_2occ(bwt, l - 1, r, c, &o_l, &o_r);
+		n_l = bwt->CC[c] + o_l + 1;
+		n_r = bwt->CC[c] + o_r;
+		if (n_l > n_r)
+			continue;
+		lut_extend(bwt, d + 1, (uint64_t)c << (d << 1) | idx, n_l, n_r);
+	}
+}
+
+void bwt_build_lut(struct bwt_t *bwt, int k)
+{
+	/* Interval of k-mer x[0..k) is stored at lut[2 * idx] and lut[2 * idx + 1]
+	 * where idx = x[0] * 4^(k - 1) + ... + x[k - 1]. Absent k-mers have l > r
+	 */
+	uint64_t i, n;
+	bwt->lut_k = k;
+	n = 1ull << (k << 1);
+	bwt->lut = malloc(n * 2 * sizeof(bioint_t));
+	for (i = 0; i < n; ++i) {
+		bwt->lut[i << 1] = 1;
+		bwt->lut[i << 1 | 1] = 0;
+	}
+	lut_extend(bwt, 0, 0, 0, bwt->seq_len);
+}
+
+int bwt_lut_query(struct bwt_t *bwt, const char *str, bioint_t *sa_beg, bioint_t *sa_end)
+{
+	uint64_t idx;
+	int i;
+	uint8_t c;
+	idx = 0;
+	for (i = 0; i < bwt->lut_k; ++i) {
+		c = nt4_table[(int)str[i]];
+		if (c > 3)
+			return 0;
+		idx = idx << 2 | c;
+	}
+	*sa_beg = bwt->lut[idx << 1];
+	*sa_end = bwt->lut[idx << 1 | 1];
+	return *sa_beg <= *sa_end;
+}
+
 uint8_t *add_seq(kseq_t *seq, uint8_t *pac, bioint_t *l_pac, uint64_t *m_pac)
 {
 	int i, c;
@@ -212,7 +321,27 @@ uint8_t *add_seq(kseq_t *seq, uint8_t *pac, bioint_t *l_pac, uint64_t *m_pac)
 	return pac;
 }
 
-struct bwt_t *bwt_build_from_fasta(const char *path)
+uint8_t *add_rev_complement(uint8_t *pac, bioint_t *l_pac, uint64_t *m_pac)
+{
+	bioint_t i, l;
+	uint64_t m;
+	l = *l_pac;
+	m = *m_pac;
+	for (i = *l_pac; i > 0; --i) {
+		if (l == m) {
+			m <<= 1;
+			pac = realloc(pac, m / 4);
+			memset(pac + l / 4, 0, (m - l) / 4);
+		}
+		__set_pac(pac, l, 3 - __get_pac(pac, i - 1));
+		++l;
+	}
+	*m_pac = m;
+	*l_pac = l;
+	return pac;
+}
+
+struct bwt_t *bwt_build_from_fasta(const char *path, int dual_strand, int sa_shift)
 {
 	struct bwt_t *bwt;
 	bwt = calloc(1, sizeof(struct bwt_t));
@@ -237,10 +366,21 @@ struct bwt_t *bwt_build_from_fasta(const char *path)
 		}
 		bwt->pac = add_seq(seq, bwt->pac, &(bwt->seq_len), &m_pac);
 	}
+	if (dual_strand) {
+		/* Both strands of a read are then found by one backward search */
+		if (MAX_PAC - bwt->seq_len < bwt->seq_len) {
+			if (sizeof(bioint_t) == 4)
+				__ERROR("Genome length with both strands exceeds 4Bbp. Use Hera 64bit instead");
+			else
+				__ERROR("Genome length is too big!!! (or something naughty happened)");
+		}
+		bwt->pac = add_rev_complement(bwt->pac, &(bwt->seq_len), &m_pac);
+		bwt->dual_strand = 1;
+	}
 	m_pac = (bwt->seq_len >> 2) + ((bwt->seq_len & 3) == 0 ? 0 : 1);
 	bwt->pac = realloc(bwt->pac, m_pac);
 	bwt_construct(bwt);
-	bwt_cal_sa(bwt);
+	bwt_cal_sa(bwt, sa_shift);
 	kseq_destroy(seq);
 	gzclose(fp);
 	return bwt;
@@ -250,6 +390,13 @@ void bwt_dump(const char *path, struct bwt_t *bwt)
 {
 	FILE *fp;
 	fp = xfopen(path, "wb");
+	// header
+	bioint_t magic = BWT_MAGIC;
+	int version = BWT_FORMAT_VERSION;
+	xfwrite(&magic, sizeof(bioint_t), 1, fp);
+	xfwrite(&version, sizeof(int), 1, fp);
+	xfwrite(&bwt->dual_strand, sizeof(int), 1, fp);
+	xfwrite(&bwt->sa_shift, sizeof(int), 1, fp);
 	// packed fasta sequences
 	bioint_t pac_len;
 	xfwrite(&bwt->seq_len, sizeof(bioint_t), 1, fp);
@@ -270,10 +417,25 @@ void bwt_load(const char *path, struct bwt_t *bwt)
 {
 	FILE *fp;
 	fp = xfopen(path, "rb");
+	// header, absent in files built before BWT_FORMAT_VERSION 1
+	int version;
+	bwt->dual_strand = 0;
+	bwt->sa_shift = SA_INTV_SHIFT;
+	xfread(&bwt->seq_len, sizeof(bioint_t), 1, fp);
+	if (bwt->seq_len == BWT_MAGIC) {
+		xfread(&version, sizeof(int), 1, fp);
+		if (version > BWT_FORMAT_VERSION)
+			__ERROR("BWT [%s] was built by a newer version of Hera-T", path);
+		xfread(&bwt->dual_strand, sizeof(int), 1, fp);
+		if (version >= 2)
+			xfread(&bwt->sa_shift, sizeof(int), 1, fp);
+		if (bwt->sa_shift < 0 || bwt->sa_shift > SA_MAX_INTV_SHIFT)
+			__ERROR("BWT [%s] is corrupted", path);
+		xfread(&bwt->seq_len, sizeof(bioint_t), 1, fp);
+	}
 	// packed fasta sequences
 	//__VERBOSE("[DEBUG] Reading fasta pack\n");
 	bioint_t pac_len;
-	xfread(&bwt->seq_len, sizeof(bioint_t), 1, fp);
 	pac_len = (bwt->seq_len >> 2) + ((bwt->seq_len & 3) == 0 ? 0 : 1);
 	bwt->pac = malloc(pac_len);
 	xfread(bwt->pac, 1, pac_len, fp);
@@ -300,6 +462,40 @@ void bwt_load(const char *path, struct bwt_t *bwt)
 	// TODO: check for integrity
 	//__VERBOSE("[DEBUG] Done reading bwt\n");
 	fclose(fp);
+	bwt->lut_k = 0;
+	bwt->lut = NULL;
+}
+
+void bwt_dump_lut(const char *path, struct bwt_t *bwt)
+{
+	FILE *fp;
+	fp = xfopen(path, "wb");
+	xfwrite(&bwt->seq_len, sizeof(bioint_t), 1, fp);
+	xfwrite(&bwt->lut_k, sizeof(int), 1, fp);
+	xfwrite(bwt->lut, sizeof(bioint_t), 2ull << (bwt->lut_k << 1), fp);
+	xwfclose(fp);
+}
+
+int bwt_load_lut(const char *path, struct bwt_t *bwt)
+{
+	/* The table is optional, return 0 if there is none for this index */
+	FILE *fp;
+	bioint_t seq_len;
+	fp = fopen(path, "rb");
+	if (!fp)
+		return 0;
+	xfread(&seq_len, sizeof(bioint_t), 1, fp);
+	if (seq_len != bwt->seq_len)
+		__ERROR("k-mer lookup table [%s] does not match the BWT", path);
+	xfread(&bwt->lut_k, sizeof(int), 1, fp);
+	if (bwt->lut_k < LUT_MIN_K || bwt->lut_k > LUT_MAX_K)
+		__ERROR("k-mer lookup table [%s] is corrupted", path);
+	__VERBOSE("Gonna allocate %llu MB for k-mer lookup table...\n",
+		  (2ull << (bwt->lut_k << 1)) * sizeof(bioint_t) / 1000000);
+	bwt->lut = malloc((2ull << (bwt->lut_k << 1)) * sizeof(bioint_t));
+	xfread(bwt->lut, sizeof(bioint_t), 2ull << (bwt->lut_k << 1), fp);
+	fclose(fp);
+	return 1;
 }
 
 void bwt_destroy(struct bwt_t *p)
@@ -308,5 +504,6 @@ void bwt_destroy(struct bwt_t *p)
 	free(p->pac);
 	free(p->bwt);
 	free(p->sa);
+	free(p->lut);
 	// free(p);
 }
@@ -49,10 +49,29 @@
 #define __get_pac(pac, l) ((pac)[(l) >> 2] >> ((~(l) & 3) << 1) & 3)
 #define __set_pac(pac, l, c) ((pac)[(l) >> 2] |= (c) << ((~(l) & 3) << 1))
 
+/* Newer .bwt files begin with this marker (never a valid seq_len) and a header */
+#define BWT_MAGIC		((bioint_t)(-1))
+#define BWT_FORMAT_VERSION	2
+
+#define SA_MAX_INTV_SHIFT	7
+
+#define LUT_MIN_K		10
+#define LUT_MAX_K		12
+
+#define BWT_BATCH_SIZE		32
+
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define __prefetch(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#else
+#define __prefetch(p) __builtin_prefetch(p)
+#endif
+
 struct bwt_t {
 	// Genome sequence
 	uint8_t *pac;
 	bioint_t seq_len;
+	int dual_strand;		// sequence is genome + its reverse complement
 
 	// BWT
 	bioint_t primary;
@@ -60,23 +79,48 @@ struct bwt_t {
 	bioint_t bwt_size;
 	uint32_t *bwt;
 
-	// SA
+	// SA, sampled at every (1 << sa_shift) rows, 0 for full SA
+	int sa_shift;
 	bioint_t n_sa;
 	bioint_t *sa;
+
+	// SA intervals of all k-mers (optional)
+	int lut_k;
+	bioint_t *lut;
 };
 
-struct bwt_t *bwt_build_from_fasta(const char *path);
+struct bwt_t *bwt_build_from_fasta(const char *path, int dual_strand, int sa_shift);
+
+void bwt_cal_sa(struct bwt_t *bwt, int sa_shift);
 
 bioint_t bwt_match_exact(struct bwt_t *bwt, const char *str, int len, bioint_t *sa_beg, bioint_t *sa_end);
 
+/* Backward search state of seq[pos + 1..end), extended one character at a time */
+struct bwt_search_t {
+	const char *seq;
+	int end;
+	int pos;			// next character to extend, -1 when done
+	bioint_t l, r;			// SA interval of seq[pos + 1..end)
+};
+
+void bwt_backward_batch(struct bwt_t *bwt, struct bwt_search_t *q, int n);
+
 void bwt_2occ(struct bwt_t *bwt, bioint_t l, bioint_t r, uint8_t c, bioint_t *o_l, bioint_t *o_r);
 
 bioint_t bwt_sa(struct bwt_t *bwt, bioint_t k);
 
+void bwt_build_lut(struct bwt_t *bwt, int k);
+
+int bwt_lut_query(struct bwt_t *bwt, const char *str, bioint_t *sa_beg, bioint_t *sa_end);
+
 void bwt_dump(const char *path, struct bwt_t *bwt);
 
 void bwt_load(const char *path, struct bwt_t *bwt);
 
+void bwt_dump_lut(const char *path, struct bwt_t *bwt);
+
+int bwt_load_lut(const char *path, struct bwt_t *bwt);
+
 void bwt_destroy(struct bwt_t *p);
 
 #endif
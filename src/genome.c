@@ -6,6 +6,7 @@
 #include "io_utils.h"
 #include "radix_sort.h"
 #include "utils.h"
+#include "verbose.h"
 
 struct gn_anchor_t {
 	int offset;
@@ -31,6 +32,10 @@ static int max_occ = 5000;
 // static int max_check_len = 100000;
 static int intron = 0;
 
+static uint8_t *amb_flag = NULL;
+static int n_amb = 0;
+static int amb_max_err = 0;
+
 static int err_sub[5][5] = {
 				{0, 1, 1, 1, 1},
 				{1, 0, 1, 1, 1},
@@ -100,7 +105,8 @@ int genome_linear(const uint8_t *pac, const char *seq, int len,
 	return err;
 }
 
-struct gn_anchor_t *get_anchor(struct gn_seed_t *se, int m, int *n)
+struct gn_anchor_t *get_anchor(struct gn_seed_t *se, int m, int *n,
+			       struct arena_t *arena)
 {
 #define __anchor_lt(x, y) ((x).pos < (y).pos || ((x).pos == (y).pos && (x).offset < (y).offset))
 	extern struct bwt_t bwt;
@@ -108,15 +114,15 @@ struct gn_anchor_t *get_anchor(struct gn_seed_t *se, int m, int *n)
 	bioint_t pos, x, j;
 	bioint_t *len, *iter;
 	int i, k, n_occ, b_i;
-	tmp = alloca(m * sizeof(struct gn_anchor_t *));
+	tmp = arena_alloc(arena, m * sizeof(struct gn_anchor_t *));
 	ret = NULL;
-	len = alloca(m * sizeof(bioint_t));
+	len = arena_alloc(arena, m * sizeof(bioint_t));
 	*n = 0;
 	for (i = 0; i < m; ++i) {
 		k = m - i - 1;
 		n_occ = se[k].r - se[k].l + 1;
 		if (n_occ < max_occ) {
-			tmp[i] = malloc(n_occ * sizeof(struct gn_anchor_t));
+			tmp[i] = arena_alloc(arena, n_occ * sizeof(struct gn_anchor_t));
 			x = 0;
 			for (j = se[k].l; j <= se[k].r; ++j) {
 				pos = bwt_sa(&bwt, j);
@@ -135,9 +141,9 @@ struct gn_anchor_t *get_anchor(struct gn_seed_t *se, int m, int *n)
 		}
 	}
 
-	ret = malloc(*n * sizeof(struct gn_seed_t));
+	ret = arena_alloc(arena, *n * sizeof(struct gn_anchor_t));
 	k = 0;
-	iter = alloca(m * sizeof(bioint_t));
+	iter = arena_alloc(arena, m * sizeof(bioint_t));
 	memset(iter, 0, sizeof(bioint_t) * m);
 	while (k < *n) {
 		b_i = -1;
@@ -150,8 +156,6 @@ struct gn_anchor_t *get_anchor(struct gn_seed_t *se, int m, int *n)
 		assert(b_i != -1);
 		ret[k++] = tmp[b_i][iter[b_i]++];
 	}
-	for (i = 0; i < m; ++i)
-		free(tmp[i]);
 	return ret;
 #undef __anchor_lt
 }
@@ -197,7 +201,7 @@ struct gn_anchor_t *get_anchor(struct gn_seed_t *se, int m, int *n)
 }*/
 
 int check_genome(struct gn_anchor_t *s, int n, const char *seq,
-					 int len, int max_err)
+		 int len, int max_err)
 {
 	int i, k, min_len, err, s_len;
 
@@ -218,84 +222,207 @@ int check_genome(struct gn_anchor_t *s, int n, const char *seq,
 	return -1;
 }
 
-int get_align_genome(const char *seq, int len, int max_err,
-		     struct worker_bundle_t *bundle, char r_str)
+static inline int init_search(const char *seq, int end, struct bwt_search_t *q)
 {
 	extern struct bwt_t bwt;
-	bioint_t l, r, o_l, o_r;
-	uint8_t c;
-	int i, k, m, n, s_len, ret;
+	q->seq = seq;
+	q->end = end;
+	q->pos = end - 1;
+	q->l = 0; q->r = bwt.seq_len;
+	if (bwt.lut_k && end >= bwt.lut_k) {
+		/* seed shorter than k-mer would never reach k_gn */
+		if (!bwt_lut_query(&bwt, seq + end - bwt.lut_k, &q->l, &q->r))
+			return 0;
+		q->pos = end - bwt.lut_k - 1;
+	}
+	return 1;
+}
+
+/* Backward searches of the 'longest' kmer and of every k_spl window */
+static int init_seed_search(const char *seq, int len, struct bwt_search_t *q)
+{
+	int i, n;
+	n = init_search(seq, len, q);
+	for (i = len - k_spl; i - k_spl >= 0; i -= k_spl)
+		n += init_search(seq, i, q + n);
+	return n;
+}
+
+static int search_genome(const char *seq, int len, int max_err,
+			 struct bwt_search_t *q, int n_q, struct arena_t *arena)
+{
+	int i, m, n, s_len;
 	struct gn_anchor_t *s;
 	struct gn_seed_t *se;
 
-	ret = -1;
-	m = len / k_spl + 1;
-	se = malloc(m * sizeof(struct gn_seed_t));
+	se = arena_alloc(arena, n_q * sizeof(struct gn_seed_t));
 	m = 0;
-	s = NULL;
-	
-	// special case for the 'longest' kmer
-	l = 0; r = bwt.seq_len;
-	for (i = len - 1; i >= 0; --i) {
-		c = nt4_table[(int)seq[i]];
-		if (c > 3) break;
-		bwt_2occ(&bwt, l - 1, r, c, &o_l, &o_r);
-		l = bwt.CC[c] + o_l + 1;
-		r = bwt.CC[c] + o_r;
-		if (l > r) break;
-		s_len = len - i;
-		if (s_len >= k_gn) {
-			m = 1;
-			se[0].offset = i;
-			se[0].l = l;
-			se[0].r = r;
-			se[0].len = s_len;
-		}
-	}
 
-	if (i < 0 && l <= r) {
-		ret = 3;
-		goto done;
-	}
-
-	for (i = len - k_spl; i - k_spl >= 0; i -= k_spl) {
-		l = 0; r = bwt.seq_len;
-		for (k = i - 1; k >= 0; --k) {
-			c = nt4_table[(int)seq[k]];
-			if (c > 3) break;
-			bwt_2occ(&bwt, l - 1, r, c, &o_l, &o_r);
-			o_l = bwt.CC[c] + o_l + 1;
-			o_r = bwt.CC[c] + o_r;
-			if (o_l > o_r) break;
-			l = o_l;
-			r = o_r;
-		}
-		assert(l <= r);
-		s_len = i - k - 1;
-		++k;
+	for (i = 0; i < n_q; ++i) {
+		// special case for the 'longest' kmer
+		if (q[i].end == len && q[i].pos < 0)
+			return 3;
+		s_len = q[i].end - q[i].pos - 1;
 		if (s_len >= k_gn) {
-			se[m].offset = k;
+			se[m].offset = q[i].pos + 1;
 			se[m].len = s_len;
-			se[m].l = l;
-			se[m].r = r;
+			se[m].l = q[i].l;
+			se[m].r = q[i].r;
 			++m;
 		}
 	}
 
-	s = get_anchor(se, m, &n);
+	s = get_anchor(se, m, &n, arena);
 	if (!n)
-		goto done;
+		return -1;
 
 	/*if (intron)
-		ret = count_intron(s, n, seq, len, max_err, bundle, r_str);
+		return count_intron(s, n, seq, len, max_err, bundle, r_str);
 	else*/
-		ret = check_genome(s, n, seq, len, max_err);
-done:
-	free(s);
-	free(se);
+		return check_genome(s, n, seq, len, max_err);
+}
+
+int get_align_genome(const char *seq, int len, int max_err,
+		     struct bwt_search_t *q, int n_q,
+		     struct worker_bundle_t *bundle, char r_str)
+{
+	return search_genome(seq, len, max_err, q, n_q, bundle->arena);
+}
+
+/* Exact searches of the disjoint AMB_SEED_LEN seeds of a window */
+static int init_window_search(const char *seq, struct bwt_search_t *q)
+{
+	int i, n;
+	n = 0;
+	for (i = 0; i + AMB_SEED_LEN <= AMB_WINDOW; i += AMB_SEED_LEN)
+		n += init_search(seq + i, AMB_SEED_LEN, q + n);
+	return n;
+}
+
+/*
+ * A locus within AMB_MAX_ERR mismatches of the window matches one of its
+ * seeds exactly. Every hit of a seed but own is checked over the window,
+ * seeds with too many hits to check leave the window ambiguous
+ */
+static int window_near_copy(const char *seq, struct bwt_search_t *q, int n_q,
+			    bioint_t own)
+{
+	extern struct bwt_t bwt;
+	bioint_t j, pos, off;
+	int i, k, err;
+
+	for (i = 0; i < n_q; ++i) {
+		if (q[i].pos >= 0)
+			continue;
+		if (q[i].r - q[i].l + 1 > (bioint_t)max_occ)
+			return 1;
+		off = q[i].seq - seq;
+		for (j = q[i].l; j <= q[i].r; ++j) {
+			pos = bwt_sa(&bwt, j);
+			if (pos < off)
+				continue;
+			pos -= off;
+			if (pos == own || pos + AMB_WINDOW > bwt.seq_len)
+				continue;
+			err = 0;
+			for (k = 0; k < AMB_WINDOW && err <= AMB_MAX_ERR; ++k)
+				err += err_sub[nt4_table[(int)seq[k]]][__get_pac(bwt.pac, pos + k)];
+			if (err <= AMB_MAX_ERR)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check whether a transcript window of AMB_WINDOW bases has a genomic hit
+ * with at most AMB_MAX_ERR mismatches other than its own exonic locus
+ * gpos (-1 if the window spans an exon junction) on strand
+ */
+int genome_window_ambiguous(const char *seq, bioint_t gpos, int strand,
+			    struct arena_t *arena)
+{
+	extern struct bwt_t bwt;
+	struct bwt_search_t *q;
+	bioint_t own_fw, own_rv;
+	char *tmp;
+	int i, ret, n_fw, n_rv;
+
+	/* seeds across an N find nothing */
+	for (i = 0; i < AMB_WINDOW; ++i)
+		if (nt4_table[(int)seq[i]] > 3)
+			return 1;
+
+	own_fw = own_rv = (bioint_t)-1;
+	if (gpos != (bioint_t)-1) {
+		if (!strand)
+			own_fw = gpos;
+		else if (bwt.dual_strand)
+			own_fw = bwt.seq_len - gpos - AMB_WINDOW;
+		else
+			own_rv = gpos;
+	}
+
+	q = arena_alloc(arena, 2 * (AMB_WINDOW / AMB_SEED_LEN) * sizeof(struct bwt_search_t));
+	n_fw = init_window_search(seq, q);
+	if (bwt.dual_strand) {
+		tmp = NULL;
+		n_rv = 0;
+	} else {
+		tmp = arena_alloc(arena, AMB_WINDOW + 1);
+		fill_rev_complement(tmp, seq, AMB_WINDOW);
+		n_rv = init_window_search(tmp, q + n_fw);
+	}
+	bwt_backward_batch(&bwt, q, n_fw + n_rv);
+
+	ret = window_near_copy(seq, q, n_fw, own_fw);
+	if (!ret && tmp)
+		ret = window_near_copy(tmp, q + n_fw, n_rv, own_rv);
 	return ret;
 }
 
+void genome_init_amb(const char *path)
+{
+	int window, step;
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return;
+	xfread(&window, sizeof(int), 1, fp);
+	xfread(&step, sizeof(int), 1, fp);
+	if (window != AMB_WINDOW || step != AMB_STEP)
+		__ERROR("Genome ambiguity annotation [%s] was built with another window setting",
+			path);
+	xfread(&amb_max_err, sizeof(int), 1, fp);
+	xfread(&n_amb, sizeof(int), 1, fp);
+	amb_flag = malloc((n_amb + 7) >> 3);
+	xfread(amb_flag, 1, (n_amb + 7) >> 3, fp);
+	fclose(fp);
+}
+
+/*
+ * Could a read aligned at [pos, pos + len) of the transcriptome with err
+ * mismatches map better on genome? A better genomic hit is within 2 * err - 1
+ * mismatches of the transcript, so of one of the m disjoint windows inside
+ * the read within (2 * err - 1) / m, which must fit the error bound the
+ * windows were annotated with
+ */
+int genome_is_ambiguous(int pos, int len, int err)
+{
+	int w, m;
+	if (!amb_flag)
+		return 1;
+	w = (pos + AMB_STEP - 1) / AMB_STEP;
+	if ((int64_t)w * AMB_STEP + AMB_WINDOW > pos + len)
+		return 1;
+	m = (pos + len - w * AMB_STEP) / AMB_WINDOW;
+	if ((2 * err - 1) / m > amb_max_err)
+		return 1;
+	for (; (int64_t)w * AMB_STEP + AMB_WINDOW <= pos + len; ++w)
+		if (w >= n_amb || (amb_flag[w >> 3] >> (w & 7) & 1))
+			return 1;
+	return 0;
+}
+
 int genome_map_err(struct read_t *read, int max_err,
 		   struct worker_bundle_t *bundle)
 {
@@ -305,17 +432,32 @@ int genome_map_err(struct read_t *read, int max_err,
 	if (max_err == 0)
 		return 1;
 
-	int ret;
+	extern struct bwt_t bwt;
+	struct bwt_search_t *q;
+	char *tmp;
+	int ret, n_fw, n_rv;
 	ret = max_err < 0? 0: 1;
 	max_err = __abs(max_err);
+
+	/* The seeds of a strand are searched in one batch so that their cache
+	 * misses overlap. The reverse strand is only searched when the forward
+	 * one does not settle the read. A dual strand index already holds the
+	 * reverse complement of the genome */
+	q = arena_alloc(bundle->arena,
+			(read->len / k_spl + 1) * sizeof(struct bwt_search_t));
+	n_fw = init_seed_search(read->seq, read->len, q);
+	bwt_backward_batch(&bwt, q, n_fw);
 	ret = __max(ret,
-		get_align_genome(read->seq, read->len, max_err, bundle, 0));
-	if (ret <= 1){
-		char *tmp = get_rev_complement(read->seq, read->len);
-		ret = __max(ret,
-			get_align_genome(tmp, read->len, max_err, bundle, 1));
-		free(tmp);
-	}
+		get_align_genome(read->seq, read->len, max_err, q, n_fw, bundle, 0));
+	if (ret > 1 || bwt.dual_strand)
+		return ret;
+
+	tmp = arena_alloc(bundle->arena, read->len + 1);
+	fill_rev_complement(tmp, read->seq, read->len);
+	n_rv = init_seed_search(tmp, read->len, q);
+	bwt_backward_batch(&bwt, q, n_rv);
+	ret = __max(ret,
+		get_align_genome(tmp, read->len, max_err, q, n_rv, bundle, 1));
 
 	return ret;
 }
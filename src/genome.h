@@ -3,9 +3,27 @@
 
 #include "attribute.h"
 #include "bwt.h"
+#include "utils.h"
+
+/* Transcriptome windows annotated at index time for off-transcript
+ * genomic hits, reads whose windows are all clean skip genome search. Hits
+ * are found through disjoint exact seeds, which catch every one within
+ * AMB_MAX_ERR mismatches */
+#define AMB_WINDOW		64
+#define AMB_STEP		16
+#define AMB_SEED_LEN		16
+#define AMB_MAX_ERR		(AMB_WINDOW / AMB_SEED_LEN - 1)
 
 void genome_init_bwt(struct bwt_t *b, int32_t count_intron);
 
+/* scratch comes from arena, which the caller resets */
+int genome_window_ambiguous(const char *seq, bioint_t gpos, int strand,
+			    struct arena_t *arena);
+
+void genome_init_amb(const char *path);
+
+int genome_is_ambiguous(int pos, int len, int err);
+
 int genome_map_err(struct read_t *read, int max_err,
 		   struct worker_bundle_t *bundle);
 
@@ -1,6 +1,7 @@
 #include <zlib.h>
 #include "attribute.h"
 #include "bwt.h"
+#include "genome.h"
 #include "hash_table.h"
 #include "index.h"
 #include "io_utils.h"
@@ -534,6 +535,85 @@ void build_transcript(const char *path)
 	xwfclose(fp);
 }
 
+/* Genome position of [off, off + len) of transcript i, -1 if not in one exon */
+static bioint_t tran_genome_pos(int i, int off, int len)
+{
+	struct exon_t *e;
+	int j, n, e_len;
+	bioint_t chr_beg;
+	n = trans->n_exon[i];
+	e = trans->exons[i];
+	chr_beg = chr_total_len[genes->chr_idx[trans->gene_idx[i]]];
+	for (j = 0; j < n; ++j) {
+		if (genes->strand[trans->gene_idx[i]] == 0) {
+			e_len = e[j].end - e[j].beg + 1;
+			if (off < e_len)
+				return off + len <= e_len ?
+					chr_beg + e[j].beg - 1 + off : (bioint_t)-1;
+		} else {
+			e_len = e[n - j - 1].end - e[n - j - 1].beg + 1;
+			if (off < e_len)
+				return off + len <= e_len ?
+					chr_beg + e[n - j - 1].end - off - len : (bioint_t)-1;
+		}
+		off -= e_len;
+	}
+	return (bioint_t)-1;
+}
+
+void build_genome_amb(const char *bwt_path, const char *lut_path,
+		      const char *path)
+{
+	struct bwt_t bwt;
+	struct arena_t *arena;
+	uint8_t *flag;
+	int i, w, n_win, tran_end, cnt, window, step, max_err;
+	bioint_t gpos;
+
+	bwt_load(bwt_path, &bwt);
+	bwt_load_lut(lut_path, &bwt);
+	genome_init_bwt(&bwt, 0);
+
+	/* windows not lying inside a single transcript stay ambiguous */
+	n_win = (trans->tran_beg[trans->n] + AMB_STEP - 1) / AMB_STEP;
+	flag = malloc((n_win + 7) >> 3);
+	memset(flag, 0xff, (n_win + 7) >> 3);
+	cnt = 0;
+	arena = init_arena(ARENA_INIT_SIZE);
+	for (i = 0; i < trans->n; ++i) {
+		if (!trans->n_exon[i])
+			continue;
+		tran_end = trans->tran_beg[i] + trans->tran_len[i];
+		for (w = (trans->tran_beg[i] + AMB_STEP - 1) / AMB_STEP;
+		     w * AMB_STEP + AMB_WINDOW <= tran_end; ++w) {
+			gpos = tran_genome_pos(i, w * AMB_STEP - trans->tran_beg[i],
+					       AMB_WINDOW);
+			arena_reset(arena);
+			if (genome_window_ambiguous(trans->seq + w * AMB_STEP, gpos,
+					genes->strand[trans->gene_idx[i]], arena))
+				++cnt;
+			else
+				flag[w >> 3] &= ~(1 << (w & 7));
+		}
+	}
+	destroy_arena(arena);
+	__VERBOSE_LOG("INFO", "Number of ambiguous transcript windows: %d / %d\n",
+		      cnt, n_win);
+
+	FILE *fp = xfopen(path, "wb");
+	window = AMB_WINDOW;
+	step = AMB_STEP;
+	max_err = AMB_MAX_ERR;
+	xfwrite(&window, sizeof(int), 1, fp);
+	xfwrite(&step, sizeof(int), 1, fp);
+	xfwrite(&max_err, sizeof(int), 1, fp);
+	xfwrite(&n_win, sizeof(int), 1, fp);
+	xfwrite(flag, 1, (n_win + 7) >> 3, fp);
+	xwfclose(fp);
+	free(flag);
+	bwt_destroy(&bwt);
+}
+
 void construct_hash(int k_s)
 {
 	init_cons_hash(27);
@@ -642,15 +722,47 @@ void build_index(int pos, int argc, char **argv)
 	log_write("\n");
 
 	// Build bwt
+	int sa_shift = SA_INTV_SHIFT;
+	if (opts->sa_intv)
+		for (sa_shift = 0; (1 << sa_shift) < opts->sa_intv; ++sa_shift);
 	if (opts->bwt) {
 		__VERBOSE_INFO("INFO", "Building Burrow-Wheeler Transform on genome...\n");
 		struct bwt_t *bwt;
-		bwt = bwt_build_from_fasta(opts->genome);
+		bwt = bwt_build_from_fasta(opts->genome, opts->dual_strand, sa_shift);
 		strcpy(str_dir, idx_name); strcat(str_dir, ".bwt");
 		bwt_dump(str_dir, bwt);
+		/* a table left by an earlier build holds intervals of the old BWT */
+		strcpy(str_dir, idx_name); strcat(str_dir, ".lut");
+		if (opts->lut_k) {
+			__VERBOSE_INFO("INFO", "Building %d-mer lookup table on BWT...\n",
+				       opts->lut_k);
+			bwt_build_lut(bwt, opts->lut_k);
+			bwt_dump_lut(str_dir, bwt);
+		} else {
+			remove(str_dir);
+		}
 		bwt_destroy(bwt);
 	} else {
 		__VERBOSE_INFO("INFO", "Not rebuild BWT\n");
+		if (opts->sa_intv || opts->lut_k) {
+			struct bwt_t bwt;
+			strcpy(str_dir, idx_name); strcat(str_dir, ".bwt");
+			bwt_load(str_dir, &bwt);
+			if (opts->sa_intv) {
+				__VERBOSE_INFO("INFO", "Resampling suffix array of existing BWT...\n");
+				free(bwt.sa);
+				bwt_cal_sa(&bwt, sa_shift);
+				bwt_dump(str_dir, &bwt);
+			}
+			if (opts->lut_k) {
+				__VERBOSE_INFO("INFO", "Building %d-mer lookup table on existing BWT...\n",
+					       opts->lut_k);
+				bwt_build_lut(&bwt, opts->lut_k);
+				strcpy(str_dir, idx_name); strcat(str_dir, ".lut");
+				bwt_dump_lut(str_dir, &bwt);
+			}
+			bwt_destroy(&bwt);
+		}
 	}
 
 	// Load fasta and gtf
@@ -676,6 +788,15 @@ void build_index(int pos, int argc, char **argv)
 	strcpy(str_dir, idx_name);
 	strcat(str_dir, ".info");
 	dump_info(str_dir);
+
+	if (opts->genome_amb) {
+		__VERBOSE_INFO("INFO", "Annotating transcript windows with off-transcript genomic hits...\n");
+		char bwt_dir[1024], lut_dir[1024];
+		strcpy(bwt_dir, idx_name); strcat(bwt_dir, ".bwt");
+		strcpy(lut_dir, idx_name); strcat(lut_dir, ".lut");
+		strcpy(str_dir, idx_name); strcat(str_dir, ".amb");
+		build_genome_amb(bwt_dir, lut_dir, str_dir);
+	}
 	free_info();
 
 	__VERBOSE_INFO("INFO", "Constructing kmer hash for transcript...\n");
@@ -16,9 +16,25 @@
 #include <sys/stat.h>
 #endif /* _MSC_VER */
 
+#define HAVE_STRUCT_TIMESPEC
+#include <pthread.h>
+#include <zlib.h>
+
+#include "atomic.h"
 #include "io_utils.h"
+#include "thread_pool.h"
+#include "utils.h"
 #include "verbose.h"
 
+struct gz_bundle_t {
+	const char *buf;
+	size_t len;
+	int n_chunks;
+	int *next;
+	char **out;
+	size_t *out_len;
+};
+
 FILE *xfopen(const char *file_path, const char *mode) {
 	FILE *fi = NULL;
 	fi = fopen(file_path, mode);
@@ -150,3 +166,65 @@ void sfs_flush(struct shared_fstream_t *p)
 	pthread_mutex_unlock(p->lock);
 	p->buf_len = 0;
 }
+
+void gz_member(const char *buf, size_t len, int level,
+	       char **out, size_t *l, size_t *m)
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z_stream));
+	/* windowBits + 16 for a gzip wrapper */
+	if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		__ERROR("Unable to init zlib deflate");
+	size_t bound = deflateBound(&z, len);
+	if (*l + bound > *m) {
+		*m = *l + bound;
+		*out = realloc(*out, *m);
+	}
+	z.next_in = (Bytef *)buf;
+	z.avail_in = len;
+	z.next_out = (Bytef *)(*out + *l);
+	z.avail_out = bound;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+		__ERROR("Unable to compress output");
+	*l += z.total_out;
+	deflateEnd(&z);
+}
+
+static void *gz_worker(void *data)
+{
+	struct gz_bundle_t *bundle = (struct gz_bundle_t *)data;
+	size_t beg, m;
+	int i;
+	while ((i = __sync_fetch_and_add32(bundle->next, 1)) < bundle->n_chunks) {
+		beg = (size_t)i * GZ_CHUNK_SIZE;
+		m = 0;
+		bundle->out_len[i] = 0;
+		gz_member(bundle->buf + beg, __min(GZ_CHUNK_SIZE, bundle->len - beg),
+			  Z_DEFAULT_COMPRESSION, bundle->out + i, bundle->out_len + i, &m);
+	}
+	return NULL;
+}
+
+void gz_write_parallel(FILE *fp, const char *buf, size_t len, int n_threads)
+{
+	struct gz_bundle_t bundle;
+	int i, next;
+
+	bundle.buf = buf;
+	bundle.len = len;
+	bundle.n_chunks = __max((len + GZ_CHUNK_SIZE - 1) / GZ_CHUNK_SIZE, 1);
+	bundle.next = &next;
+	bundle.out = calloc(bundle.n_chunks, sizeof(char *));
+	bundle.out_len = calloc(bundle.n_chunks, sizeof(size_t));
+	next = 0;
+	n_threads = __min(n_threads, bundle.n_chunks);
+
+	thread_pool_run(gz_worker, &bundle, 0, n_threads);
+
+	for (i = 0; i < bundle.n_chunks; ++i) {
+		xfwrite(bundle.out[i], 1, bundle.out_len[i], fp);
+		free(bundle.out[i]);
+	}
+	free(bundle.out);
+	free(bundle.out_len);
+}
@@ -44,6 +44,18 @@ void make_dir(const char *path);
 /* get size of all file from file_path */
 size_t fetch_size(char **file_path, int n_file);
 
+/* ------------ gzip utils ------------ */
+
+#define GZ_CHUNK_SIZE		SIZE_1MB
+
+/* Append buf as one gzip member to out (l bytes used of m) */
+void gz_member(const char *buf, size_t len, int level,
+	       char **out, size_t *l, size_t *m);
+
+/* Write buf as concatenated gzip members of GZ_CHUNK_SIZE compressed on
+ * n_threads */
+void gz_write_parallel(FILE *fp, const char *buf, size_t len, int n_threads);
+
 /* ------------ shared_stream_t utils ------------ */
 
 /* Init shared stream on n threads */
@@ -1,48 +1,29 @@
 #define HAVE_STRUCT_TIMESPEC
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "io_utils.h"
 #include "kmhash.h"
 #include "pthread_barrier.h"
 #include "semaphore_wrapper.h"
+#include "thread_pool.h"
 #include "utils.h"
 #include "verbose.h"
 #include "atomic.h"
+#include "radix_sort.h"
 
 #define __hash_int(x) (uint64_t)((x) >> 33 ^ (x) ^ (x) << 11)
 
 #define KMFLAG_EMPTY			0
 #define KMFLAG_OLD			1
 #define KMFLAG_NEW			2
-#define KMFLAG_LOADING			3
 
 #define __round_up_kmint(x) 	(--(x), (x) |= (x) >> 1,		       \
 				 (x) |= (x) >> 2, (x) |= (x) >> 4,	       \
 				 (x) |= (x) >> 8, (x) |= (x) >> 16,	       \
 				 ++(x))
 
-#define rs_set_old(x, i) ((x)[(i) >> 4] = ((x)[(i) >> 4] &		       \
-				(~((uint32_t)3 << (((i) & 15) << 1)))) |       \
-				((uint32_t)KMFLAG_OLD << (((i) & 15) << 1)))
-
-#define rs_set_new(x, i) ((x)[(i) >> 4] = ((x)[(i) >> 4] &		       \
-				(~((uint32_t)3 << (((i) & 15) << 1)))) |       \
-				((uint32_t)KMFLAG_NEW << (((i) & 15) << 1)))
-
-#define rs_set_empty(x, i) ((x)[(i) >> 4] = (x)[(i) >> 4] &		       \
-				(~((uint32_t)3 << (((i) & 15) << 1))))
-
-#define rs_get_flag(x, i) (((x)[(i) >> 4] >> (((i) & 15) << 1)) & (uint32_t)3)
-
-#define rs_is_old(x, i) ((((x)[(i) >> 4] >> (((i) & 15) << 1)) & (uint32_t)3)  \
-							== (uint32_t)KMFLAG_OLD)
-
-#define rs_is_empty(x, i) ((((x)[(i) >> 4] >> (((i) & 15) << 1)) & (uint32_t)3)  \
-							== (uint32_t)KMFLAG_EMPTY)
-
-#define rs_is_new(x, i) ((((x)[(i) >> 4] >> (((i) & 15) << 1)) & (uint32_t)3)  \
-							== (uint32_t)KMFLAG_NEW)
-
 #define HM_MAGIC_1			UINT64_C(0xbf58476d1ce4e5b9)
 #define HM_MAGIC_2			UINT64_C(0x94d049bb133111eb)
 
@@ -58,6 +39,17 @@ static inline uint64_t __hash_int2(kmkey_t k)
 	return x;
 }
 
+#define bu_get_block(p, s, mask) ((s) >= 64 ? (p).bc >> ((s) - 64) & (mask) : \
+						   (p).umi >> (s) & (mask))
+#define bu_less_than(x, y) ((x).bc < (y).bc || ((x).bc == (y).bc && (x).umi < (y).umi))
+
+RS_IMPL(bc_umi, struct bc_umi_t, 128, 8, bu_less_than, bu_get_block)
+
+#define __kmsort_part(bc) (__hash_int2(bc) & (KMSORT_N_PARTITIONS - 1))
+
+#define __kmhash_key_lock(h, key) ((h)->shared_bucket_locks +		       \
+		(__hash_int2(key) & KMHASH_N_SHARED_BUCKET_LOCKS_MASK))
+
 static inline kmint_t estimate_probe_3(kmint_t size)
 {
 	kmint_t s, i;
@@ -69,19 +61,98 @@ static inline kmint_t estimate_probe_3(kmint_t size)
 	return i;
 }
 
-static struct umi_hash_t *init_umi_hash()
+static struct umi_pool_t *umi_pools;
+
+/* words of n keys and their counts */
+#define __umi_words(n) ((n) + (n) / 2)
+
+/* size in words of each class: umi_hash_t header and the two list sizes */
+static const kmint_t umipool_class[UMIPOOL_N_CLASSES] = {
+	sizeof(struct umi_hash_t) / sizeof(kmkey_t),
+	__umi_words(KMHASH_UMIHASH_MAX_LIST >> 2),
+	__umi_words(KMHASH_UMIHASH_MAX_LIST)
+};
+
+#define __umipool_stripe(x) (__hash_int2((uint64_t)(x)) & (UMIPOOL_N_STRIPES - 1))
+
+static void init_umi_pools()
+{
+	int i;
+	if (umi_pools)
+		return;
+	umi_pools = calloc(UMIPOOL_N_STRIPES, sizeof(struct umi_pool_t));
+	for (i = 0; i < UMIPOOL_N_STRIPES; ++i) {
+		pthread_mutex_init(&umi_pools[i].lock, NULL);
+		umi_pools[i].used = UMIPOOL_CHUNK_SIZE;
+	}
+}
+
+static kmkey_t *umipool_alloc(uint64_t stripe, int c)
+{
+	struct umi_pool_t *pool = umi_pools + stripe;
+	kmkey_t *ret;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->free_list[c]) {
+		ret = pool->free_list[c];
+		pool->free_list[c] = (kmkey_t *)(uintptr_t)ret[0];
+	} else {
+		if (pool->used + umipool_class[c] > UMIPOOL_CHUNK_SIZE) {
+			pool->chunk = malloc(UMIPOOL_CHUNK_SIZE * sizeof(kmkey_t));
+			pool->used = 0;
+		}
+		ret = pool->chunk + pool->used;
+		pool->used += umipool_class[c];
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ret;
+}
+
+static void umipool_free(uint64_t stripe, int c, kmkey_t *p)
+{
+	struct umi_pool_t *pool = umi_pools + stripe;
+	pthread_mutex_lock(&pool->lock);
+	p[0] = (kmkey_t)(uintptr_t)pool->free_list[c];
+	pool->free_list[c] = p;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static inline int umipool_list_class(kmint_t size)
+{
+	return size == KMHASH_UMIHASH_MAX_LIST ? 2 : 1;
+}
+
+/* hint spreads new headers over the pool stripes */
+static struct umi_hash_t *init_umi_hash(uint64_t hint)
 {
 	struct umi_hash_t *umis;
-	umis = calloc(1, sizeof(struct umi_hash_t));
-	umis->size = KMHASH_UMIHASH_SIZE;
-	umis->bucks = malloc(umis->size * sizeof(kmkey_t));
+	umis = (struct umi_hash_t *)umipool_alloc(__umipool_stripe(hint), 0);
+	umis->size = KMHASH_UMIHASH_INLINE;
+	umis->bucks = umis->inl;
 	umis->n_items = 0;
-	memset(umis->bucks, 255, sizeof(kmkey_t) * umis->size);
+	memset(umis->inl, 255, sizeof(kmkey_t) * KMHASH_UMIHASH_INLINE);
+	memset(umis->inl_cnt, 0, sizeof(uint32_t) * KMHASH_UMIHASH_INLINE);
 	return umis;
 }
 
-static kmint_t internal_umihash_put(struct umi_hash_t *h, kmkey_t key)
+/* Add cnt reads to key, nothing is changed if there is no room */
+static kmint_t internal_umihash_put(struct umi_hash_t *h, kmkey_t key, uint32_t cnt)
 {
+	uint32_t *c = __umihash_cnt(h);
+	if (h->size <= KMHASH_UMIHASH_MAX_LIST) {
+		kmint_t i;
+		for (i = 0; i < h->n_items; ++i) {
+			if (h->bucks[i] == key) {
+				c[i] += cnt;
+				return i;
+			}
+		}
+		if (h->n_items == h->size)
+			return KMHASH_MAX_SIZE;
+		h->bucks[h->n_items] = key;
+		c[h->n_items] = cnt;
+		return h->n_items++;
+	}
+
 	if (h->n_items >= (kmint_t)(h->size * KMHASH_UPPER))
 		return KMHASH_MAX_SIZE;
 
@@ -90,44 +161,53 @@ static kmint_t internal_umihash_put(struct umi_hash_t *h, kmkey_t key)
 	mask = h->size - 1;
 	k = __hash_int(key);
 	last = i = k & mask;
-	if (h->bucks[i] == TOMB_STONE) {
-		h->bucks[i] = key;
-		++h->n_items;
-		return i;
-	}
 	while (h->bucks[i] != TOMB_STONE && h->bucks[i] != key) {
 		i = (i + (++step)) & mask;
 		if (i == last)
-			break;
+			return KMHASH_MAX_SIZE;
 	}
 	if (h->bucks[i] == TOMB_STONE) {
 		h->bucks[i] = key;
+		c[i] = cnt;
 		++h->n_items;
-		return i;
+	} else {
+		c[i] += cnt;
 	}
-	return h->bucks[i] == key ? i : KMHASH_MAX_SIZE;
+	return i;
 }
 
-kmint_t kmhash_get(struct kmhash_t *h, kmkey_t key)
+/* A key moved by a resize may be beyond n_probe, look up to an empty bucket */
+static kmint_t bucks_get(struct kmbucket_t *bucks, kmint_t size, kmkey_t key)
 {
 	kmint_t mask, i, step = 0;
 	uint64_t k;
-	mask = h->size - 1;
+	mask = size - 1;
 	k = __hash_int2(key);
 	i = k & mask;
 	do {
 		i = (i + step * (step + 1) / 2) & mask;
-		if (h->bucks[i].idx == key)
+		if (bucks[i].idx == key)
 			return i;
 		++step;
-	} while (step <= h->n_probe && h->bucks[i].idx != TOMB_STONE);
+	} while (step < size && bucks[i].idx != TOMB_STONE);
 	return KMHASH_MAX_SIZE;
 }
 
+kmint_t kmhash_get(struct kmhash_t *h, kmkey_t key)
+{
+	return bucks_get(h->bucks, h->size, key);
+}
+
 kmint_t umihash_get(struct umi_hash_t *h, kmkey_t key)
 {
 	kmint_t mask, i, last, step = 0;
 	uint64_t k;
+	if (h->size <= KMHASH_UMIHASH_MAX_LIST) {
+		for (i = 0; i < h->n_items; ++i)
+			if (h->bucks[i] == key)
+				return i;
+		return KMHASH_MAX_SIZE;
+	}
 	mask = h->size - 1;
 	k = __hash_int(key);
 	last = i = k & mask;
@@ -139,22 +219,27 @@ kmint_t umihash_get(struct umi_hash_t *h, kmkey_t key)
 	return h->bucks[i] == key ? i : KMHASH_MAX_SIZE;
 }
 
-static kmint_t internal_kmhash_put(struct kmhash_t *h, kmkey_t key)
+/*
+ * A moved key is already counted in n_items and must find a bucket, so it
+ * may probe the whole table instead of n_probe buckets
+ */
+static kmint_t internal_kmhash_put(struct kmhash_t *h, kmkey_t key, int is_move)
 {
-	kmint_t mask, i, step = 0;
+	kmint_t mask, i, n_probe, step = 0;
 	kmkey_t cur_key;
 	uint64_t k;
 
 	mask = h->size - 1;
+	n_probe = is_move ? mask : h->n_probe;
 	k = __hash_int2(key);
 	i = k & mask;
 	do {
 		i = (i + step * (step + 1) / 2) & mask;
 		cur_key = __sync_val_compare_and_swap_kmkey(&(h->bucks[i].idx), TOMB_STONE, key);
 		++step;
-	} while (step <= h->n_probe && cur_key != key && cur_key != TOMB_STONE);
+	} while (step <= n_probe && cur_key != key && cur_key != TOMB_STONE);
 	if (cur_key == TOMB_STONE || cur_key == key) {
-		if (cur_key == TOMB_STONE) {
+		if (cur_key == TOMB_STONE && !is_move) {
 			// init_bc_bucks(h->bucks + i, h->n_workers);
 			__sync_fetch_and_add_kmint(&(h->n_items), 1);
 		}
@@ -163,124 +248,6 @@ static kmint_t internal_kmhash_put(struct kmhash_t *h, kmkey_t key)
 	return KMHASH_MAX_SIZE;
 }
 
-void *kmresize_worker(void *data)
-{
-	struct kmresize_bundle_t *bundle = (struct kmresize_bundle_t *)data;
-	struct kmhash_t *h;
-	kmint_t i, l, r, mask, cap;
-
-	h = bundle->h;
-	mask = h->size - 1;
-	/* Init all buckets */
-	cap = (h->size - h->old_size) / bundle->n_threads + 1;
-	l = cap * bundle->thread_no;
-	r = __min(cap * (bundle->thread_no + 1), h->size - h->old_size);
-	for (i = l; i < r; ++i) {
-		h->bucks[h->old_size + i].idx = TOMB_STONE;
-		h->bucks[h->old_size + i].umis = NULL;
-	}
-
-	cap = h->old_size / bundle->n_threads + 1;
-	l = cap * bundle->thread_no;
-	r = __min(cap * (bundle->thread_no + 1), h->old_size);
-	for (i = l; i < r; ++i) {
-		if (h->bucks[i].idx != TOMB_STONE)
-			h->flag[i] = KMFLAG_OLD;
-	}
-
-	pthread_barrier_wait(bundle->barrier);
-
-	for (i = l; i < r; ++i) {
-		if (__sync_val_compare_and_swap8(h->flag + i, KMFLAG_OLD, KMFLAG_LOADING)
-								== KMFLAG_OLD) {
-			kmkey_t x = h->bucks[i].idx, xt;
-			struct umi_hash_t *y = h->bucks[i].umis, *yt;
-			h->bucks[i].idx = TOMB_STONE;
-			h->bucks[i].umis = NULL;
-			h->flag[i] = KMFLAG_EMPTY;
-			while (1) {
-				uint64_t k = __hash_int2(x);
-				kmint_t j = k & mask, step = 0;
-				uint8_t current_flag = KMFLAG_NEW;
-				while (step <= h->n_probe) {
-					if ((current_flag = __sync_val_compare_and_swap8(h->flag + j,
-							KMFLAG_OLD, KMFLAG_NEW))
-								== KMFLAG_OLD) {
-						h->bucks[j].idx = x;
-						h->bucks[j].umis = y;
-						break;
-					} else if ((current_flag = __sync_val_compare_and_swap8(h->flag +j,
-							KMFLAG_EMPTY, KMFLAG_NEW))
-								== KMFLAG_EMPTY) {
-						xt = h->bucks[j].idx;
-						yt = h->bucks[j].umis;
-						h->bucks[j].idx = x;
-						h->bucks[j].umis = y;
-						x = xt;
-						y = yt;
-						break;
-					} else if (current_flag == KMFLAG_LOADING) {
-						/* not sure */
-						continue;
-					}
-					++step;
-					j = (j + step * (step + 1) / 2) & mask;
-				}
-				if (current_flag == KMFLAG_EMPTY)
-					break;
-				else if (current_flag == KMFLAG_NEW)
-					__ERROR("[Multi-thread] resize kmhash failed");
-			}
-		}
-	}
-	pthread_exit(NULL);
-}
-
-void kmhash_resize_multi(struct kmhash_t *h)
-{
-	int n_threads, i;
-	n_threads = h->n_workers;
-
-	h->old_size = h->size;
-	h->size <<= 1;
-	h->n_probe = estimate_probe_3(h->size);
-	h->bucks = realloc(h->bucks, h->size * sizeof(struct kmbucket_t));
-	h->flag = calloc(h->size, sizeof(uint8_t));
-
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-
-	pthread_t *t;
-	t = calloc(h->n_workers, sizeof(pthread_t));
-
-	pthread_barrier_t barrier;
-	pthread_barrier_init(&barrier, NULL, n_threads);
-
-	struct kmresize_bundle_t *bundles;
-	bundles = calloc(n_threads, sizeof(struct kmresize_bundle_t));
-
-	for (i = 0; i < n_threads; ++i) {
-		bundles[i].n_threads = n_threads;
-		bundles[i].thread_no = i;
-		bundles[i].h = h;
-		bundles[i].barrier = &barrier;
-		pthread_create(t + i, &attr, kmresize_worker, bundles + i);
-	}
-
-	for (i = 0; i < n_threads; ++i)
-		pthread_join(t[i], NULL);
-
-	pthread_attr_destroy(&attr);
-	pthread_barrier_destroy(&barrier);
-
-	free(t);
-	free(bundles);
-	free(h->flag);
-	h->flag = NULL;
-}
-
 void kmhash_resize_single(struct kmhash_t *h)
 {
 	kmint_t old_size, mask, i;
@@ -342,126 +309,773 @@ void kmhash_resize_single(struct kmhash_t *h)
 	free(flag);
 }
 
-void kmhash_resize(struct kmhash_t *h)
+/* Move bucket i of old_bucks, the caller holds the lock of its key */
+static void kmhash_move_bucket(struct kmhash_t *h, kmint_t i)
 {
-	int i;
-	for (i = 0; i < h->n_workers; ++i)
-		pthread_mutex_lock(h->locks + i);
+	kmint_t k;
+	if (h->flag[i] != KMFLAG_EMPTY)
+		return;
+	k = internal_kmhash_put(h, h->old_bucks[i].idx, 1);
+	if (k == KMHASH_MAX_SIZE)
+		__ERROR("Moving a barcode to the resized hash table failed");
+	h->bucks[k].umis = h->old_bucks[i].umis;
+	h->flag[i] = KMFLAG_NEW;
+}
+
+static void kmhash_migrate_step(struct kmhash_t *h)
+{
+	kmint_t beg, end, i;
+	pthread_mutex_t *lock;
+	if (h->migrate_next >= h->old_size)
+		return;
+	beg = __sync_fetch_and_add_kmint(&(h->migrate_next), KMHASH_MIGRATE_CHUNK);
+	if (beg >= h->old_size)
+		return;
+	end = __min(beg + KMHASH_MIGRATE_CHUNK, h->old_size);
+	for (i = beg; i < end; ++i) {
+		if (h->old_bucks[i].idx == TOMB_STONE)
+			continue;
+		lock = __kmhash_key_lock(h, h->old_bucks[i].idx);
+		pthread_mutex_lock(lock);
+		kmhash_move_bucket(h, i);
+		pthread_mutex_unlock(lock);
+	}
+	__sync_fetch_and_add_kmint(&(h->n_migrated), end - beg);
+}
 
+/*
+ * Publish a table twice as big. The previous one must be fully moved first
+ * and the new array is built before the workers are held, so they are only
+ * held to swap the arrays
+ */
+static void kmhash_grow(struct kmhash_t *h)
+{
+	struct kmbucket_t *bucks;
+	uint8_t *flag;
+	kmint_t size, i;
+	int k;
+
+	if (!__sync_bool_compare_and_swap32(&(h->status), KMHASH_IDLE, KMHASH_BUSY))
+		return;
 	if (h->size == KMHASH_MAX_SIZE)
 		__ERROR("The barcodes hash table is too big (exceeded %llu)",
 			(unsigned long long)KMHASH_MAX_SIZE);
 
-	kmhash_resize_single(h);
-	/*
-	if (h->size <= KMHASH_SINGLE_RESIZE)
-		kmhash_resize_single(h);
-	else
-		kmhash_resize_multi(h);
-	*/
+	while (h->old_bucks && h->n_migrated < h->old_size) {
+		kmhash_migrate_step(h);
+		if (h->migrate_next >= h->old_size)
+			__thread_yield();
+	}
 
-	for (i = 0; i < h->n_workers; ++i)
-		pthread_mutex_unlock(h->locks + i);
+	size = h->size << 1;
+	bucks = malloc(size * sizeof(struct kmbucket_t));
+	for (i = 0; i < size; ++i) {
+		bucks[i].idx = TOMB_STONE;
+		bucks[i].umis = NULL;
+	}
+	flag = calloc(h->size, sizeof(uint8_t));
+
+	for (k = 0; k < h->n_workers; ++k)
+		pthread_mutex_lock(h->locks + k);
+	free(h->old_bucks);
+	free(h->flag);
+	h->old_bucks = h->bucks;
+	h->old_size = h->size;
+	h->flag = flag;
+	h->bucks = bucks;
+	h->size = size;
+	h->n_probe = estimate_probe_3(size);
+	h->migrate_next = h->n_migrated = 0;
+	for (k = 0; k < h->n_workers; ++k)
+		pthread_mutex_unlock(h->locks + k);
+
+	__sync_val_compare_and_swap32(&(h->status), KMHASH_BUSY, KMHASH_IDLE);
 }
 
-static void umihash_resize(struct umi_hash_t *h)
+void kmhash_finish_resize(struct kmhash_t *h)
 {
-	kmint_t old_size, mask, i;
+	while (h->old_bucks && h->n_migrated < h->old_size)
+		kmhash_migrate_step(h);
+	free(h->old_bucks);
+	free(h->flag);
+	h->old_bucks = NULL;
+	h->flag = NULL;
+	h->old_size = 0;
+}
+
+/* Keys and counts moved to a hash twice as big, the caller frees old */
+static void umihash_rehash(struct umi_hash_t *h)
+{
+	kmkey_t *old;
+	uint32_t *old_cnt;
+	kmint_t old_size, i;
+	old = h->bucks;
+	old_cnt = __umihash_cnt(h);
 	old_size = h->size;
 	h->size <<= 1;
-	mask = h->size - 1;
-	h->bucks = realloc(h->bucks, sizeof(kmkey_t) * h->size);
-	uint32_t *flag = calloc(h->size >> 4, sizeof(uint32_t));
-
-	for (i = old_size; i < h->size; ++i)
-		h->bucks[i] = TOMB_STONE;
+	h->n_items = 0;
+	h->bucks = malloc(__umi_words(h->size) * sizeof(kmkey_t));
+	memset(h->bucks, 255, h->size * sizeof(kmkey_t));
+	for (i = 0; i < old_size; ++i)
+		if (old[i] != TOMB_STONE)
+			internal_umihash_put(h, old[i], old_cnt[i]);
+}
 
-	for (i = 0; i < old_size; ++i) {
-		if (h->bucks[i] != TOMB_STONE)
-			rs_set_old(flag, i);
+/* Move a list to the next tier, the largest list becomes a hash */
+static void umihash_grow_list(struct umi_hash_t *h)
+{
+	kmkey_t *old;
+	uint32_t *old_cnt;
+	kmint_t old_size;
+	uint64_t stripe;
+	old = h->bucks;
+	old_cnt = __umihash_cnt(h);
+	old_size = h->size;
+	stripe = __umipool_stripe(h);
+	if (old_size < KMHASH_UMIHASH_MAX_LIST) {
+		h->size <<= 2;
+		h->bucks = umipool_alloc(stripe, umipool_list_class(h->size));
+		memcpy(h->bucks, old, old_size * sizeof(kmkey_t));
+		memset(h->bucks + old_size, 255, (h->size - old_size) * sizeof(kmkey_t));
+		memcpy(__umihash_cnt(h), old_cnt, old_size * sizeof(uint32_t));
+	} else {
+		umihash_rehash(h);
 	}
+	if (old != h->inl)
+		umipool_free(stripe, umipool_list_class(old_size), old);
+}
 
-	for (i = 0; i < old_size; ++i) {
-		if (rs_is_old(flag, i)) {
-			kmkey_t x = h->bucks[i], xt;
-			h->bucks[i] = TOMB_STONE;
-			rs_set_empty(flag, i);
-			while (1) {
-				uint64_t k = __hash_int(x);
-				kmint_t j, last, step = 0;
-				j = last = k & mask;
-				while (!rs_is_empty(flag, j) && !rs_is_old(flag, j)) {
-					j = (j + (++step)) & mask;
-					if (j == last)
-						break;
-				}
-				if (rs_is_empty(flag, j)) {
-					rs_set_new(flag, j);
-					h->bucks[j] = x;
-					break;
-				} else if (rs_is_old(flag, j)) {
-					rs_set_new(flag, j);
-					xt = h->bucks[j];
-					h->bucks[j] = x;
-					x = xt;
-				} else {
-					__ERROR("Resize UMI hash failed");
-				}
-			}
-		}
+static void umihash_resize(struct umi_hash_t *h)
+{
+	kmkey_t *old;
+	if (h->size <= KMHASH_UMIHASH_MAX_LIST) {
+		umihash_grow_list(h);
+		return;
 	}
-	free(flag);
+	old = h->bucks;
+	umihash_rehash(h);
+	free(old);
 }
 
+/* The caller holds the lock of the bucket's key */
 static void internal_kmhash_put_umi(struct kmhash_t *h, kmint_t bucket_location, kmkey_t umi)
 {
 	kmint_t k;
 	struct kmbucket_t *b;
-	pthread_mutex_t *lock_bucket;
 	b = h->bucks + bucket_location;
-	lock_bucket = h->shared_bucket_locks + (bucket_location & KMHASH_N_SHARED_BUCKET_LOCKS_MASK);
-	pthread_mutex_lock(lock_bucket);
 	if (b->umis == NULL)
-		b->umis = init_umi_hash();
-	k = internal_umihash_put(b->umis, umi);
+		b->umis = init_umi_hash(bucket_location);
+	k = internal_umihash_put(b->umis, umi, 1);
 	while (k == KMHASH_MAX_SIZE) {
 		umihash_resize(b->umis);
-		k = internal_umihash_put(b->umis, umi);
+		k = internal_umihash_put(b->umis, umi, 1);
 	}
-	pthread_mutex_unlock(lock_bucket);
 }
 
-void umihash_put_umi_single(struct umi_hash_t *h, kmkey_t key)
+void umihash_put_umi_single(struct umi_hash_t *h, kmkey_t key, uint32_t cnt)
 {
 	kmint_t k;
-	k = internal_umihash_put(h, key);
+	k = internal_umihash_put(h, key, cnt);
 	while (k == KMHASH_MAX_SIZE) {
 		umihash_resize(h);
-		k = internal_umihash_put(h, key);
+		k = internal_umihash_put(h, key, cnt);
 	}
 }
 
+/*
+ * lock is the worker's own one, only held by others to publish a grown
+ * table. A key still in old_bucks is moved before it is put
+ */
 void kmhash_put_bc_umi(struct kmhash_t *h, pthread_mutex_t *lock,
 						kmkey_t bc, kmkey_t umi)
 {
+	pthread_mutex_t *lock_key;
 	kmint_t k;
-	pthread_mutex_lock(lock);
-	k = internal_kmhash_put(h, bc);
-	if (k != KMHASH_MAX_SIZE)
-		internal_kmhash_put_umi(h, k, umi);
-	pthread_mutex_unlock(lock);
-
-	while (k == KMHASH_MAX_SIZE) {
-		if (__sync_bool_compare_and_swap32(&(h->status), KMHASH_IDLE, KMHASH_BUSY)) {
-			kmhash_resize(h);
-			__sync_val_compare_and_swap32(&(h->status), KMHASH_BUSY, KMHASH_IDLE);
-		}
+	int full;
+	lock_key = __kmhash_key_lock(h, bc);
+	do {
 		pthread_mutex_lock(lock);
-		k = internal_kmhash_put(h, bc);
+		pthread_mutex_lock(lock_key);
+		if (h->old_bucks) {
+			k = bucks_get(h->old_bucks, h->old_size, bc);
+			if (k != KMHASH_MAX_SIZE)
+				kmhash_move_bucket(h, k);
+		}
+		k = internal_kmhash_put(h, bc, 0);
 		if (k != KMHASH_MAX_SIZE)
 			internal_kmhash_put_umi(h, k, umi);
+		pthread_mutex_unlock(lock_key);
+		if (h->old_bucks)
+			kmhash_migrate_step(h);
+		full = k == KMHASH_MAX_SIZE ||
+		       h->n_items >= (kmint_t)(h->size * KMHASH_UPPER);
 		pthread_mutex_unlock(lock);
+		if (full)
+			kmhash_grow(h);
+	} while (k == KMHASH_MAX_SIZE);
+}
+
+/* Reads of equal tuples are summed */
+static size_t bc_umi_unique(struct bc_umi_t *a, size_t n)
+{
+	size_t i, k;
+	for (i = k = 0; i < n; ++i) {
+		if (!k || a[i].bc != a[k - 1].bc || a[i].umi != a[k - 1].umi)
+			a[k++] = a[i];
+		else
+			a[k - 1].cnt += a[i].cnt;
+	}
+	return k;
+}
+
+static void bc_buffer_compact(struct bc_buffer_t *b)
+{
+	rs_sort(bc_umi, b->a, b->a + b->n);
+	b->n = bc_umi_unique(b->a, b->n);
+}
+
+struct bc_spill_t *init_bc_spill(const char *prefix, int n_parts, int n_files,
+			       size_t m_max)
+{
+	struct bc_spill_t *sp;
+	int f;
+	sp = calloc(1, sizeof(struct bc_spill_t));
+	sp->n_parts = n_parts;
+	sp->n_files = n_files;
+	sp->m_max = m_max;
+	pthread_mutex_init(&sp->lock, NULL);
+	pthread_cond_init(&sp->cond, NULL);
+	sp->files = calloc(n_files, sizeof(struct bc_spill_file_t));
+	for (f = 0; f < n_files; ++f) {
+		sp->files[f].path = malloc(strlen(prefix) + 16);
+		sprintf(sp->files[f].path, "%s.%d", prefix, f);
+		sp->files[f].fp = xfopen(sp->files[f].path, "w+b");
+		pthread_mutex_init(&sp->files[f].lock, NULL);
+	}
+	return sp;
+}
+
+/* Append a run to file f, a holds cnt[p] tuples of each partition p in order */
+void bc_spill_write(struct bc_spill_t *sp, int f, struct bc_umi_t *a, size_t *cnt)
+{
+	struct bc_spill_file_t *file;
+	size_t *off;
+	int p;
+	file = sp->files + f;
+	file->off = realloc(file->off, (size_t)(file->n_runs + 1) *
+			    (sp->n_parts + 1) * sizeof(size_t));
+	off = file->off + (size_t)file->n_runs * (sp->n_parts + 1);
+	off[0] = file->n;
+	for (p = 0; p < sp->n_parts; ++p)
+		off[p + 1] = off[p] + cnt[p];
+	xfwrite(a, sizeof(struct bc_umi_t), off[sp->n_parts] - off[0], file->fp);
+	/* runs are read back by other threads while others are being written */
+	fflush(file->fp);
+	file->n = off[sp->n_parts];
+	++file->n_runs;
+}
+
+/* Number of tuples of partitions [beg, end) */
+size_t bc_spill_size(struct bc_spill_t *sp, int beg, int end)
+{
+	struct bc_spill_file_t *file;
+	size_t *off, n;
+	int f, r;
+	n = 0;
+	for (f = 0; f < sp->n_files; ++f) {
+		file = sp->files + f;
+		for (r = 0; r < file->n_runs; ++r) {
+			off = file->off + (size_t)r * (sp->n_parts + 1);
+			n += off[end] - off[beg];
+		}
+	}
+	return n;
+}
+
+#if defined(_MSC_VER)
+static void bc_spill_read(struct bc_spill_file_t *file, struct bc_umi_t *a,
+			  size_t pos, size_t len)
+{
+	int ok;
+	pthread_mutex_lock(&file->lock);
+	ok = !_fseeki64(file->fp, (__int64)(pos * sizeof(struct bc_umi_t)), SEEK_SET) &&
+	     fread(a, sizeof(struct bc_umi_t), len, file->fp) == len;
+	fseek(file->fp, 0, SEEK_END);
+	pthread_mutex_unlock(&file->lock);
+	if (!ok)
+		__ERROR("Unable to read spilled UMIs from [%s]", file->path);
+}
+#else
+static void bc_spill_read(struct bc_spill_file_t *file, struct bc_umi_t *a,
+			  size_t pos, size_t len)
+{
+	char *p;
+	size_t l;
+	off_t o;
+	ssize_t ret;
+	p = (char *)a;
+	l = len * sizeof(struct bc_umi_t);
+	o = (off_t)(pos * sizeof(struct bc_umi_t));
+	while (l) {
+		ret = pread(fileno(file->fp), p, l, o);
+		if (ret <= 0)
+			__ERROR("Unable to read spilled UMIs from [%s]", file->path);
+		p += ret;
+		l -= ret;
+		o += ret;
+	}
+}
+#endif /* _MSC_VER */
+
+/*
+ * Tuples of partitions [beg, end) of every run, in file then run order.
+ * Partitions of one run are contiguous so each run is read at once.
+ * Returned tuples count against m_max until bc_spill_unload
+ */
+size_t bc_spill_load(struct bc_spill_t *sp, int beg, int end, struct bc_umi_t **a)
+{
+	struct bc_spill_file_t *file;
+	size_t *off, n;
+	int f, r;
+	n = bc_spill_size(sp, beg, end);
+	if (sp->m_max) {
+		pthread_mutex_lock(&sp->lock);
+		while (sp->n_loaded && sp->n_loaded + n > sp->m_max)
+			pthread_cond_wait(&sp->cond, &sp->lock);
+		sp->n_loaded += n;
+		pthread_mutex_unlock(&sp->lock);
+	}
+	*a = malloc(__max(n, 1) * sizeof(struct bc_umi_t));
+	n = 0;
+	for (f = 0; f < sp->n_files; ++f) {
+		file = sp->files + f;
+		for (r = 0; r < file->n_runs; ++r) {
+			off = file->off + (size_t)r * (sp->n_parts + 1);
+			bc_spill_read(file, *a + n, off[beg], off[end] - off[beg]);
+			n += off[end] - off[beg];
+		}
+	}
+	return n;
+}
+
+/* n is the number of tuples bc_spill_load returned with a */
+void bc_spill_unload(struct bc_spill_t *sp, struct bc_umi_t *a, size_t n)
+{
+	free(a);
+	if (!sp->m_max)
+		return;
+	pthread_mutex_lock(&sp->lock);
+	sp->n_loaded -= n;
+	pthread_cond_broadcast(&sp->cond);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+void bc_spill_destroy(struct bc_spill_t *sp)
+{
+	int f;
+	if (!sp) return;
+	for (f = 0; f < sp->n_files; ++f) {
+		fclose(sp->files[f].fp);
+		remove(sp->files[f].path);
+		free(sp->files[f].path);
+		free(sp->files[f].off);
+		pthread_mutex_destroy(&sp->files[f].lock);
+	}
+	pthread_mutex_destroy(&sp->lock);
+	pthread_cond_destroy(&sp->cond);
+	free(sp->files);
+	free(sp);
+}
+
+/* Compacted buffer grouped by partition and written as one run */
+static void bc_buffer_spill(struct bc_buffer_t *b)
+{
+	struct bc_umi_t *tmp;
+	size_t cnt[KMSORT_N_PARTITIONS], off[KMSORT_N_PARTITIONS], i;
+	int p;
+	assert(b->spill->n_parts == KMSORT_N_PARTITIONS);
+	memset(cnt, 0, KMSORT_N_PARTITIONS * sizeof(size_t));
+	for (i = 0; i < b->n; ++i)
+		++cnt[__kmsort_part(b->a[i].bc)];
+	off[0] = 0;
+	for (p = 1; p < KMSORT_N_PARTITIONS; ++p)
+		off[p] = off[p - 1] + cnt[p - 1];
+	tmp = malloc(__max(b->n, 1) * sizeof(struct bc_umi_t));
+	for (i = 0; i < b->n; ++i)
+		tmp[off[__kmsort_part(b->a[i].bc)]++] = b->a[i];
+	bc_spill_write(b->spill, b->f, tmp, cnt);
+	free(tmp);
+	b->n = 0;
+}
+
+void bc_buffer_put(struct bc_buffer_t *b, kmkey_t bc, kmkey_t umi)
+{
+	if (b->n == b->m) {
+		bc_buffer_compact(b);
+		/* grow only if deduplication did not free half of the buffer */
+		if (b->n >= (b->m >> 1)) {
+			if (b->spill && b->m && (b->m << 1) > b->m_max) {
+				bc_buffer_spill(b);
+			} else {
+				b->m = b->m ? b->m << 1 : KMSORT_BUFFER_SIZE;
+				b->a = realloc(b->a, b->m * sizeof(struct bc_umi_t));
+			}
+		}
+	}
+	b->a[b->n].bc = bc;
+	b->a[b->n].umi = umi;
+	b->a[b->n].cnt = 1;
+	++b->n;
+}
+
+void bc_buffer_destroy(struct bc_buffer_t *b)
+{
+	free(b->a);
+	b->a = NULL;
+	b->n = b->m = 0;
+}
+
+static kmint_t internal_kmhash_put_single(struct kmhash_t *h, kmkey_t key)
+{
+	kmint_t mask, i, step = 0;
+	uint64_t k;
+
+	mask = h->size - 1;
+	k = __hash_int2(key);
+	i = k & mask;
+	do {
+		i = (i + step * (step + 1) / 2) & mask;
+		if (h->bucks[i].idx == TOMB_STONE) {
+			h->bucks[i].idx = key;
+			++h->n_items;
+			return i;
+		}
+		++step;
+	} while (step <= h->n_probe && h->bucks[i].idx != key);
+	return h->bucks[i].idx == key ? i : KMHASH_MAX_SIZE;
+}
+
+/* Insert a whole barcode bucket into a table only used by one thread */
+static void kmhash_put_bucket_single(struct kmhash_t *h, kmkey_t bc,
+				     struct umi_hash_t *umis)
+{
+	kmint_t k;
+	while ((k = internal_kmhash_put_single(h, bc)) == KMHASH_MAX_SIZE)
+		kmhash_resize_single(h);
+	h->bucks[k].umis = umis;
+}
+
+/* UMI hash of n tuples inserted in the given order */
+struct umi_hash_t *umihash_build(struct bc_umi_t *a, size_t n, uint64_t hint)
+{
+	struct umi_hash_t *umis;
+	size_t i;
+	umis = init_umi_hash(hint);
+	for (i = 0; i < n; ++i)
+		umihash_put_umi_single(umis, a[i].umi, a[i].cnt);
+	return umis;
+}
+
+/*
+ * Each thread sorts its own buffer and groups it by partition, then merges
+ * the partitions it owns from every buffer into runs of barcodes
+ */
+void *kmsort_worker(void *data)
+{
+	struct kmsort_bundle_t *bundle = (struct kmsort_bundle_t *)data;
+	struct bc_buffer_t *b;
+	struct bc_umi_t *tmp, *part;
+	size_t *off, i, k, n, len;
+	kmint_t m;
+	int p, t;
+
+	b = bundle->bufs + bundle->thread_no;
+	off = bundle->offset + bundle->thread_no * (KMSORT_N_PARTITIONS + 1);
+	bc_buffer_compact(b);
+	memset(off, 0, (KMSORT_N_PARTITIONS + 1) * sizeof(size_t));
+	for (i = 0; i < b->n; ++i)
+		++off[__kmsort_part(b->a[i].bc) + 1];
+	for (p = 0; p < KMSORT_N_PARTITIONS; ++p)
+		off[p + 1] += off[p];
+	tmp = malloc(b->n * sizeof(struct bc_umi_t));
+	for (i = 0; i < b->n; ++i)
+		tmp[off[__kmsort_part(b->a[i].bc)]++] = b->a[i];
+	for (p = KMSORT_N_PARTITIONS; p > 0; --p)
+		off[p] = off[p - 1];
+	off[0] = 0;
+	free(b->a);
+	b->a = tmp;
+
+	pthread_barrier_wait(bundle->barrier);
+
+	for (p = bundle->thread_no; p < KMSORT_N_PARTITIONS; p += bundle->n_threads) {
+		n = 0;
+		for (t = 0; t < bundle->n_bufs; ++t) {
+			off = bundle->offset + t * (KMSORT_N_PARTITIONS + 1);
+			n += off[p + 1] - off[p];
+		}
+		part = malloc(n * sizeof(struct bc_umi_t));
+		n = 0;
+		for (t = 0; t < bundle->n_bufs; ++t) {
+			off = bundle->offset + t * (KMSORT_N_PARTITIONS + 1);
+			len = off[p + 1] - off[p];
+			memcpy(part + n, bundle->bufs[t].a + off[p],
+			       len * sizeof(struct bc_umi_t));
+			n += len;
+		}
+		rs_sort(bc_umi, part, part + n);
+		n = bc_umi_unique(part, n);
+
+		m = 0;
+		for (i = 0; i < n; i = k) {
+			for (k = i + 1; k < n && part[k].bc == part[i].bc; ++k);
+			++m;
+		}
+		bundle->bcs[p] = malloc(__max(m, 1) * sizeof(struct kmbucket_t));
+		bundle->n_bcs[p] = 0;
+		for (i = 0; i < n; i = k) {
+			for (k = i + 1; k < n && part[k].bc == part[i].bc; ++k);
+			bundle->bcs[p][bundle->n_bcs[p]].idx = part[i].bc;
+			bundle->bcs[p][bundle->n_bcs[p]].umis =
+					umihash_build(part + i, k - i, part[i].bc);
+			++bundle->n_bcs[p];
+		}
+		free(part);
+	}
+	return NULL;
+}
+
+/*
+ * Each thread spills what is left in its own buffer, then counts the UMIs
+ * of the barcodes of the partitions it owns, one partition at a time and
+ * within the spill's m_max unless a single partition is larger
+ */
+void *kmspill_worker(void *data)
+{
+	struct kmsort_bundle_t *bundle = (struct kmsort_bundle_t *)data;
+	struct bc_buffer_t *b;
+	struct bc_umi_t *part;
+	struct umi_hash_t *umis;
+	size_t i, k, n, n_part;
+	kmint_t m;
+	int p;
+
+	b = bundle->bufs + bundle->thread_no;
+	bc_buffer_compact(b);
+	if (b->n)
+		bc_buffer_spill(b);
+	bc_buffer_destroy(b);
+
+	pthread_barrier_wait(bundle->barrier);
+
+	for (p = bundle->thread_no; p < KMSORT_N_PARTITIONS; p += bundle->n_threads) {
+		n_part = bc_spill_load(bundle->spill, p, p + 1, &part);
+		rs_sort(bc_umi, part, part + n_part);
+		n = bc_umi_unique(part, n_part);
+
+		m = 0;
+		for (i = 0; i < n; i = k) {
+			for (k = i + 1; k < n && part[k].bc == part[i].bc; ++k);
+			++m;
+		}
+		bundle->bcs[p] = malloc(__max(m, 1) * sizeof(struct kmbucket_t));
+		bundle->n_bcs[p] = 0;
+		for (i = 0; i < n; i = k) {
+			for (k = i + 1; k < n && part[k].bc == part[i].bc; ++k);
+			umis = init_umi_hash(part[i].bc);
+			umis->n_items = k - i;
+			bundle->bcs[p][bundle->n_bcs[p]].idx = part[i].bc;
+			bundle->bcs[p][bundle->n_bcs[p]].umis = umis;
+			++bundle->n_bcs[p];
+		}
+		bc_spill_unload(bundle->spill, part, n_part);
 	}
+	return NULL;
+}
+
+/*
+ * Barcodes are inserted by partition then by value so that the table does
+ * not depend on the number of threads
+ */
+static struct kmhash_t *kmhash_build_parts(void *(*func)(void *),
+		struct bc_buffer_t *bufs, struct bc_spill_t *sp, int n_threads)
+{
+	struct kmhash_t *h;
+	struct kmsort_bundle_t *bundles;
+	struct kmbucket_t *bcs[KMSORT_N_PARTITIONS];
+	kmint_t n_bcs[KMSORT_N_PARTITIONS], i, n;
+	size_t *offset;
+	int p;
+
+	init_umi_pools();
+
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, n_threads);
+
+	offset = malloc(n_threads * (KMSORT_N_PARTITIONS + 1) * sizeof(size_t));
+	bundles = calloc(n_threads, sizeof(struct kmsort_bundle_t));
+	for (p = 0; p < n_threads; ++p) {
+		bundles[p].bufs = bufs;
+		bundles[p].n_bufs = n_threads;
+		bundles[p].n_threads = n_threads;
+		bundles[p].thread_no = p;
+		bundles[p].offset = offset;
+		bundles[p].bcs = bcs;
+		bundles[p].n_bcs = n_bcs;
+		bundles[p].spill = sp;
+		bundles[p].barrier = &barrier;
+	}
+	thread_pool_run(func, bundles, sizeof(struct kmsort_bundle_t), n_threads);
+
+	pthread_barrier_destroy(&barrier);
+	free(bundles);
+	free(offset);
+	for (p = 0; p < n_threads; ++p)
+		bc_buffer_destroy(bufs + p);
+
+	n = 0;
+	for (p = 0; p < KMSORT_N_PARTITIONS; ++p)
+		n += n_bcs[p];
+	h = init_kmhash(__max(n << 1, KMHASH_KMHASH_SIZE), 1);
+	h->n_probe = estimate_probe_3(h->size);
+	for (p = 0; p < KMSORT_N_PARTITIONS; ++p) {
+		for (i = 0; i < n_bcs[p]; ++i)
+			kmhash_put_bucket_single(h, bcs[p][i].idx, bcs[p][i].umis);
+		free(bcs[p]);
+	}
+	return h;
+}
+
+/*
+ * Build the barcodes hash from thread-local tuples without any lock on the
+ * alignment path
+ */
+struct kmhash_t *kmhash_build_sorted(struct bc_buffer_t *bufs, int n_threads)
+{
+	return kmhash_build_parts(kmsort_worker, bufs, NULL, n_threads);
+}
+
+struct kmhash_t *kmhash_build_spill(struct bc_buffer_t *bufs,
+				    struct bc_spill_t *sp, int n_threads)
+{
+	return kmhash_build_parts(kmspill_worker, bufs, sp, n_threads);
+}
+
+struct bc_partition_t *init_bc_partition(int n_threads)
+{
+	struct bc_partition_t *bp;
+	int i;
+	bp = calloc(1, sizeof(struct bc_partition_t));
+	bp->n = n_threads;
+	bp->boxes = calloc(n_threads * n_threads, sizeof(struct bc_mailbox_t));
+	for (i = 0; i < n_threads * n_threads; ++i)
+		bp->boxes[i].a = malloc(KMBOX_SIZE * sizeof(struct bc_umi_t));
+	bp->h = malloc(n_threads * sizeof(struct kmhash_t *));
+	for (i = 0; i < n_threads; ++i) {
+		bp->h[i] = init_kmhash(KMHASH_KMHASH_SIZE, 1);
+		bp->h[i]->n_probe = estimate_probe_3(bp->h[i]->size);
+	}
+	bp->n_put = calloc(n_threads, sizeof(int));
+	bp->n_done = 0;
+	return bp;
+}
+
+static void bc_partition_insert(struct kmhash_t *h, kmkey_t bc, kmkey_t umi)
+{
+	kmint_t k;
+	while ((k = internal_kmhash_put_single(h, bc)) == KMHASH_MAX_SIZE)
+		kmhash_resize_single(h);
+	if (h->bucks[k].umis == NULL)
+		h->bucks[k].umis = init_umi_hash(k);
+	umihash_put_umi_single(h->bucks[k].umis, umi, 1);
+}
+
+/* Owner of partition p consumes what every other worker has sent to it */
+static void bc_partition_drain(struct bc_partition_t *bp, int p)
+{
+	struct bc_mailbox_t *box;
+	kmint_t i, tail;
+	int q;
+	for (q = 0; q < bp->n; ++q) {
+		if (q == p)
+			continue;
+		box = bp->boxes + q * bp->n + p;
+		tail = box->tail;
+		__sync_full_barrier();
+		for (i = box->head; i != tail; i = (i + 1) & (KMBOX_SIZE - 1))
+			bc_partition_insert(bp->h[p], box->a[i].bc, box->a[i].umi);
+		__sync_full_barrier();
+		box->head = tail;
+	}
+}
+
+void bc_partition_put(struct bc_partition_t *bp, int thread_no,
+		      kmkey_t bc, kmkey_t umi)
+{
+	struct bc_mailbox_t *box;
+	kmint_t tail;
+	int p;
+	p = __hash_int2(bc) % bp->n;
+	if (p == thread_no) {
+		bc_partition_insert(bp->h[p], bc, umi);
+	} else {
+		box = bp->boxes + thread_no * bp->n + p;
+		tail = box->tail;
+		/* keep consuming own partition while the owner of p catches up */
+		while (((tail + 1) & (KMBOX_SIZE - 1)) == box->head)
+			bc_partition_drain(bp, thread_no);
+		box->a[tail].bc = bc;
+		box->a[tail].umi = umi;
+		__sync_full_barrier();
+		box->tail = (tail + 1) & (KMBOX_SIZE - 1);
+	}
+	if (++bp->n_put[thread_no] == KMBOX_DRAIN_INTERVAL) {
+		bp->n_put[thread_no] = 0;
+		bc_partition_drain(bp, thread_no);
+	}
+}
+
+/* Called once by each align worker after its last read */
+void bc_partition_finish(struct bc_partition_t *bp, int thread_no)
+{
+	__sync_fetch_and_add32(&bp->n_done, 1);
+	while (bp->n_done < bp->n)
+		bc_partition_drain(bp, thread_no);
+	bc_partition_drain(bp, thread_no);
+}
+
+/*
+ * Cut-off and correction of barcodes rank all barcodes together, so the
+ * partitions are gathered into one table once counting is done
+ */
+struct kmhash_t *kmhash_build_partition(struct bc_partition_t *bp)
+{
+	struct kmhash_t *h;
+	kmint_t n, k;
+	int p;
+
+	n = 0;
+	for (p = 0; p < bp->n; ++p)
+		n += bp->h[p]->n_items;
+	h = init_kmhash(__max(n << 1, KMHASH_KMHASH_SIZE), 1);
+	h->n_probe = estimate_probe_3(h->size);
+	for (p = 0; p < bp->n; ++p) {
+		for (k = 0; k < bp->h[p]->size; ++k) {
+			if (bp->h[p]->bucks[k].idx == TOMB_STONE)
+				continue;
+			kmhash_put_bucket_single(h, bp->h[p]->bucks[k].idx,
+						 bp->h[p]->bucks[k].umis);
+			bp->h[p]->bucks[k].umis = NULL;
+		}
+		kmhash_destroy(bp->h[p]);
+	}
+	for (p = 0; p < bp->n * bp->n; ++p)
+		free(bp->boxes[p].a);
+	free(bp->boxes);
+	free(bp->h);
+	free(bp->n_put);
+	free(bp);
+	return h;
 }
 
 struct kmhash_t *init_kmhash(kmint_t size, int n_threads)
@@ -469,6 +1083,7 @@ struct kmhash_t *init_kmhash(kmint_t size, int n_threads)
 	struct kmhash_t *h;
 	kmint_t i;
 
+	init_umi_pools();
 	h = calloc(1, sizeof(struct kmhash_t));
 	h->size = size;
 	__round_up_kmint(h->size);
@@ -477,6 +1092,7 @@ struct kmhash_t *init_kmhash(kmint_t size, int n_threads)
 		h->bucks[i].idx = TOMB_STONE;
 		h->bucks[i].umis = NULL;
 	}
+	h->n_probe = estimate_probe_3(h->size);
 	h->n_workers = n_threads;
 	h->locks = calloc(h->n_workers, sizeof(pthread_mutex_t));
 	int k;
@@ -492,14 +1108,19 @@ struct kmhash_t *init_kmhash(kmint_t size, int n_threads)
 void umihash_destroy(struct umi_hash_t *h)
 {
 	if (!h) return;
-	free(h->bucks);
-	free(h);
+	uint64_t stripe = __umipool_stripe(h);
+	if (h->size > KMHASH_UMIHASH_MAX_LIST)
+		free(h->bucks);
+	else if (h->bucks != h->inl)
+		umipool_free(stripe, umipool_list_class(h->size), h->bucks);
+	umipool_free(stripe, 0, (kmkey_t *)h);
 }
 
 void kmhash_destroy(struct kmhash_t *h)
 {
 	if (!h) return;
 	kmint_t i;
+	kmhash_finish_resize(h);
 	for (i = 0; i < h->size; ++i) {
 		umihash_destroy(h->bucks[i].umis);
 	}
@@ -515,3 +1136,84 @@ void kmhash_destroy(struct kmhash_t *h)
 	free(h);
 }
 
+
+struct bc_count_t *init_bc_count(kmint_t size)
+{
+	struct bc_count_t *h;
+	h = calloc(1, sizeof(struct bc_count_t));
+	__round_up_kmint(size);
+	h->size = size;
+	h->n_items = 0;
+	h->keys = malloc(h->size * sizeof(kmkey_t));
+	h->cnt = calloc(h->size, sizeof(uint32_t));
+	memset(h->keys, 255, h->size * sizeof(kmkey_t));
+	return h;
+}
+
+static kmint_t internal_bc_count_put(struct bc_count_t *h, kmkey_t key)
+{
+	kmint_t mask, i;
+	mask = h->size - 1;
+	i = __hash_int2(key) & mask;
+	while (h->keys[i] != TOMB_STONE && h->keys[i] != key)
+		i = (i + 1) & mask;
+	if (h->keys[i] == TOMB_STONE) {
+		h->keys[i] = key;
+		++h->n_items;
+	}
+	return i;
+}
+
+static void bc_count_resize(struct bc_count_t *h)
+{
+	kmkey_t *keys;
+	uint32_t *cnt;
+	kmint_t old_size, i, k;
+	keys = h->keys;
+	cnt = h->cnt;
+	old_size = h->size;
+	h->size <<= 1;
+	h->n_items = 0;
+	h->keys = malloc(h->size * sizeof(kmkey_t));
+	h->cnt = calloc(h->size, sizeof(uint32_t));
+	memset(h->keys, 255, h->size * sizeof(kmkey_t));
+	for (i = 0; i < old_size; ++i) {
+		if (keys[i] == TOMB_STONE)
+			continue;
+		k = internal_bc_count_put(h, keys[i]);
+		h->cnt[k] = cnt[i];
+	}
+	free(keys);
+	free(cnt);
+}
+
+void bc_count_add(struct bc_count_t *h, kmkey_t key, uint32_t cnt)
+{
+	kmint_t k;
+	if (h->n_items >= (kmint_t)(h->size * KMHASH_UPPER))
+		bc_count_resize(h);
+	k = internal_bc_count_put(h, key);
+	h->cnt[k] += cnt;
+}
+
+kmint_t bc_count_get(struct bc_count_t *h, kmkey_t key)
+{
+	kmint_t mask, i;
+	mask = h->size - 1;
+	i = __hash_int2(key) & mask;
+	while (h->keys[i] != TOMB_STONE) {
+		if (h->keys[i] == key)
+			return i;
+		i = (i + 1) & mask;
+	}
+	return KMHASH_MAX_SIZE;
+}
+
+void bc_count_destroy(struct bc_count_t *h)
+{
+	if (!h)
+		return;
+	free(h->keys);
+	free(h->cnt);
+	free(h);
+}
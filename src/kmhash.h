@@ -4,6 +4,7 @@
 #define HAVE_STRUCT_TIMESPEC
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "atomic.h"
 #include "pthread_barrier.h"
@@ -15,9 +16,11 @@ typedef uint32_t kmint_t;
 #define __sync_bool_compare_and_swap_kmint __sync_bool_compare_and_swap32
 
 #define KMHASH_MAX_SIZE				UINT32_C(0x80000000)
-#define KMHASH_UMIHASH_SIZE			UINT32_C(0x10)
+#define KMHASH_UMIHASH_INLINE			UINT32_C(0x2)
+#define KMHASH_UMIHASH_MAX_LIST			UINT32_C(0x20)
 #define KMHASH_KMHASH_SIZE			UINT32_C(0x10000)
 #define KMHASH_SINGLE_RESIZE			UINT32_C(0x100000)
+#define KMHASH_MIGRATE_CHUNK			UINT32_C(0x400)
 #define KMHASH_N_SHARED_BUCKET_LOCKS		UINT32_C(0x4000)
 #define KMHASH_N_SHARED_BUCKET_LOCKS_MASK	(UINT32_C(0x4000) - 1)
 
@@ -31,10 +34,33 @@ typedef uint64_t kmkey_t;
 #define __sync_bool_compare_and_swap_kmkey __sync_bool_compare_and_swap64
 typedef uint64_t kmval_t;
 
+/*
+ * UMIs of one barcode. Up to KMHASH_UMIHASH_INLINE entries live in inl, up
+ * to KMHASH_UMIHASH_MAX_LIST in a packed list from the UMI pool, beyond that
+ * bucks is an open addressing hash. Unused slots are always TOMB_STONE.
+ * The read count of bucks[i] is __umihash_cnt(h)[i], counts are stored
+ * right after the keys, inl_cnt right after inl
+ */
 struct umi_hash_t {
 	kmint_t size;
 	kmint_t n_items;
 	kmkey_t *bucks;
+	kmkey_t inl[KMHASH_UMIHASH_INLINE];
+	uint32_t inl_cnt[KMHASH_UMIHASH_INLINE];
+};
+
+#define __umihash_cnt(h) ((uint32_t *)((h)->bucks + (h)->size))
+
+#define UMIPOOL_N_STRIPES		64
+#define UMIPOOL_CHUNK_SIZE		0x8000
+#define UMIPOOL_N_CLASSES		3
+
+/* Slab of UMI hash headers and small lists, one free list per size class */
+struct umi_pool_t {
+	pthread_mutex_t lock;
+	kmkey_t *chunk;
+	kmint_t used;
+	kmkey_t *free_list[UMIPOOL_N_CLASSES];
 };
 
 struct kmbucket_t {
@@ -42,13 +68,21 @@ struct kmbucket_t {
 	struct umi_hash_t *umis;
 };
 
+/*
+ * The shared table grows without stopping the workers: old_bucks are moved
+ * to bucks when their key is put and by chunks swept on every put, flag
+ * tells which ones are moved. Each key is only touched under its lock from
+ * shared_bucket_locks
+ */
 struct kmhash_t {
 	kmint_t size;
 	kmint_t old_size;
 	kmint_t n_items;
 	kmint_t n_probe;
 	struct kmbucket_t *bucks;
-	// struct kmbucket_t *old_bucks;
+	struct kmbucket_t *old_bucks;
+	kmint_t migrate_next;		// next chunk of old_bucks to sweep
+	kmint_t n_migrated;		// buckets of old_bucks swept
 	uint8_t *flag;
 	int status;
 	int n_workers;
@@ -59,10 +93,97 @@ struct kmhash_t {
 	int *pos;
 };
 
-struct kmresize_bundle_t {
-	struct kmhash_t *h;
+/* (barcode, umi << GENE_BIT_LEN | gene) tuple and its number of reads */
+struct bc_umi_t {
+	kmkey_t bc;
+	kmkey_t umi;
+	uint32_t cnt;
+};
+
+/*
+ * Runs of tuples on disk, one file per writer. A run is grouped by
+ * partition, off holds the n_parts + 1 tuple offsets of each run
+ */
+struct bc_spill_file_t {
+	FILE *fp;
+	char *path;
+	size_t n;
+	int n_runs;
+	size_t *off;
+	pthread_mutex_t lock;	// seek then read, where there is no pread
+};
+
+/*
+ * Loads wait while other threads hold more than m_max tuples, a lone load
+ * is always let through. m_max = 0 does not bound the loads
+ */
+struct bc_spill_t {
+	int n_parts;
+	int n_files;
+	struct bc_spill_file_t *files;
+	size_t m_max;
+	size_t n_loaded;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/*
+ * Thread-local tuples, sorted and deduplicated whenever the buffer is full.
+ * With a spill, a buffer that would grow beyond m_max is written to file f
+ */
+struct bc_buffer_t {
+	struct bc_umi_t *a;
+	size_t n;
+	size_t m;
+	size_t m_max;
+	struct bc_spill_t *spill;
+	int f;
+};
+
+#define KMSORT_N_PARTITIONS		256
+#define KMSORT_BUFFER_SIZE		0x10000
+
+#define KMBOX_SIZE			0x400
+#define KMBOX_DRAIN_INTERVAL		0x40
+
+/* Single producer single consumer ring of tuples bound for one partition */
+struct bc_mailbox_t {
+	struct bc_umi_t *a;
+	volatile kmint_t tail;
+	char pad[60];
+	volatile kmint_t head;
+};
+
+/*
+ * Barcodes sharded by hash, partition p is owned by align worker p which is
+ * the only one inserting into h[p]. Worker q sends tuples of partition p
+ * through boxes[q * n + p]
+ */
+struct bc_partition_t {
+	int n;
+	struct bc_mailbox_t *boxes;
+	struct kmhash_t **h;
+	int *n_put;
+	volatile int n_done;
+};
+
+/* Number of reads of each barcode, single writer, linear probing */
+struct bc_count_t {
+	kmint_t size;
+	kmint_t n_items;
+	kmkey_t *keys;
+	uint32_t *cnt;
+};
+
+struct kmsort_bundle_t {
+	struct bc_buffer_t *bufs;
+	int n_bufs;
 	int n_threads;
 	int thread_no;
+	size_t *offset;
+	struct kmbucket_t **bcs;
+	kmint_t *n_bcs;
+	struct bc_spill_t *spill;
 	pthread_barrier_t *barrier;
 };
 
@@ -73,12 +194,60 @@ void kmhash_destroy(struct kmhash_t *h);
 void kmhash_put_bc_umi(struct kmhash_t *h, pthread_mutex_t *lock,
 						kmkey_t bc, kmkey_t umi);
 
-void umihash_put_umi_single(struct umi_hash_t *h, kmkey_t key);
+/* Move what is left of an ongoing resize once no one puts anymore */
+void kmhash_finish_resize(struct kmhash_t *h);
+
+void umihash_put_umi_single(struct umi_hash_t *h, kmkey_t key, uint32_t cnt);
+
+void bc_buffer_put(struct bc_buffer_t *b, kmkey_t bc, kmkey_t umi);
+
+void bc_buffer_destroy(struct bc_buffer_t *b);
+
+struct kmhash_t *kmhash_build_sorted(struct bc_buffer_t *bufs, int n_threads);
+
+struct bc_spill_t *init_bc_spill(const char *prefix, int n_parts, int n_files,
+			       size_t m_max);
+
+void bc_spill_write(struct bc_spill_t *sp, int f, struct bc_umi_t *a, size_t *cnt);
+
+size_t bc_spill_size(struct bc_spill_t *sp, int beg, int end);
+
+size_t bc_spill_load(struct bc_spill_t *sp, int beg, int end, struct bc_umi_t **a);
+
+void bc_spill_unload(struct bc_spill_t *sp, struct bc_umi_t *a, size_t n);
+
+void bc_spill_destroy(struct bc_spill_t *sp);
+
+/*
+ * Spill what is left in the buffers, then count the UMIs of each barcode one
+ * partition at a time. Barcodes of the table only have their number of UMIs
+ */
+struct kmhash_t *kmhash_build_spill(struct bc_buffer_t *bufs,
+				    struct bc_spill_t *sp, int n_threads);
+
+struct bc_partition_t *init_bc_partition(int n_threads);
+
+void bc_partition_put(struct bc_partition_t *bp, int thread_no,
+		      kmkey_t bc, kmkey_t umi);
+
+void bc_partition_finish(struct bc_partition_t *bp, int thread_no);
+
+struct kmhash_t *kmhash_build_partition(struct bc_partition_t *bp);
+
+struct bc_count_t *init_bc_count(kmint_t size);
+
+void bc_count_add(struct bc_count_t *h, kmkey_t key, uint32_t cnt);
+
+kmint_t bc_count_get(struct bc_count_t *h, kmkey_t key);
+
+void bc_count_destroy(struct bc_count_t *h);
 
 kmint_t kmhash_get(struct kmhash_t *h, kmkey_t key);
 
 kmint_t umihash_get(struct umi_hash_t *h, kmkey_t key);
 
+struct umi_hash_t *umihash_build(struct bc_umi_t *a, size_t n, uint64_t hint);
+
 void umihash_destroy(struct umi_hash_t *h);
 
 #endif
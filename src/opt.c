@@ -1,4 +1,5 @@
 #include "attribute.h"
+#include "bwt.h"
 #include "io_utils.h"
 #include "library_type.h"
 #include "opt.h"
@@ -47,6 +48,13 @@ void print_index_usage()
 	__VERBOSE("To build Hera-T index\n");
 	__VERBOSE("\n");
 	__VERBOSE("Usage: ./hera-T index -g <path/to/genome_fasta> -t <path/to/gene_gtf> -p <index_prefix> -o <output_folder>\n");
+	__VERBOSE("Option:\n");
+	__VERBOSE("--kmer-lut\t: Length k (%d-%d) of k-mer lookup table to speed up genome search, 0 to disable (default)\n",
+		  LUT_MIN_K, LUT_MAX_K);
+	__VERBOSE("--sa-intv\t: Suffix array sampling interval, power of 2 up to %d, 1 for full suffix array (default: %d)\n",
+		  1 << SA_MAX_INTV_SHIFT, SA_INTV);
+	__VERBOSE("--dual-strand\t: Index both genome strands so that genome search is done once per read (double BWT size)\n");
+	__VERBOSE("--genome-amb\t: Annotate transcript windows having off-transcript genomic hits so that count only searches genome for reads on them\n");
 	__VERBOSE("Example: ./hera-T index -g Homo_sapiens.GRCh37.75.dna_sm.primary_assembly.fa -t Homo_sapiens.GRCh37.75.gtf -o index -p grch37\n");
 	__VERBOSE("\n");
 }
@@ -64,6 +72,14 @@ void print_count_usage()
 	__VERBOSE("-l\t: Library types\n");
 	__VERBOSE("\t\t%u: 10X-Chromium 3' (v2) protocol\n", CHROMIUM3_V2);
 	__VERBOSE("\t\t%u: 10X-Chromium 3' (v3) protocol\n", CHROMIUM3_V3);
+	__VERBOSE("--sort-umi\t: Aggregate barcodes and UMIs by sorting thread-local buffers instead of a shared hash table\n");
+	__VERBOSE("--partition-bc\t: Shard barcodes by hash, each shard owned by one thread that receives UMIs through mailboxes\n");
+	__VERBOSE("--two-pass\t: Count barcodes from read 1 first, keep UMIs only of candidate cells and their neighbours\n");
+	__VERBOSE("--gzip\t\t: Write matrix.mtx.gz, barcodes.tsv.gz and features.tsv.gz (v3 layout) compressed on all threads\n");
+	__VERBOSE("--raw\t\t: Also write the matrix of all barcodes left after correction to raw/\n");
+	__VERBOSE("--csc\t\t: Also write matrix.csc, a memory-mappable binary sparse matrix of genes by cells\n");
+	__VERBOSE("--mem-limit\t: Memory in MB for barcodes and UMIs, beyond it they are spilled to --temp-dir\n");
+	__VERBOSE("--pin-threads\t: Bind each thread to a core (Linux only)\n");
 	__VERBOSE("Example: ./hera-T count -t 32 -o ./result -x index/grch37 -l 0 -1 lane_0.read_1.fq lane_1.read_1.fq -2 lane_0.read_2.fq lane_1.read_2.fq\n");
 	//__VERBOSE("--count-intron\t: Count both exonic and intronic reads\n");
 	__VERBOSE("\n");
@@ -81,6 +97,14 @@ static struct opt_count_t *init_opt_count()
 	opt->n_threads = 1;
 	opt->is_dump_align = 0;
 	opt->count_intron = 0;
+	opt->sort_umi = 0;
+	opt->partition_bc = 0;
+	opt->two_pass = 0;
+	opt->gzip_out = 0;
+	opt->csc_out = 0;
+	opt->raw_out = 0;
+	opt->mem_limit = 0;
+	opt->pin_threads = 0;
 	opt->left_file = opt->right_file = NULL;
 	opt->log_file = "herat.log";
 	return opt;
@@ -96,6 +120,10 @@ static struct opt_index_t *init_opt_index()
 	opt->idx_dir = "./";
 	opt->k = 29;
 	opt->bwt = 1;
+	opt->dual_strand = 0;
+	opt->sa_intv = 0;
+	opt->lut_k = 0;
+	opt->genome_amb = 0;
 	return opt;
 }
 
@@ -109,6 +137,13 @@ static void check_valid_opt_index(struct opt_index_t *opt)
 
 	if (!opt->prefix)
 		__OPT_ERROR("Missing -p argument");
+
+	if (opt->sa_intv && (opt->sa_intv > (1 << SA_MAX_INTV_SHIFT) ||
+			     (opt->sa_intv & (opt->sa_intv - 1))))
+		__OPT_ERROR("Invalid suffix array sampling interval: %d", opt->sa_intv);
+
+	if (opt->lut_k && (opt->lut_k < LUT_MIN_K || opt->lut_k > LUT_MAX_K))
+		__OPT_ERROR("Invalid k-mer lookup table length: %d", opt->lut_k);
 }
 
 static void check_valid_opt_count(struct opt_count_t *opt)
@@ -127,6 +162,12 @@ static void check_valid_opt_count(struct opt_count_t *opt)
 
 	if (opt->right_file == NULL)
 		__OPT_ERROR("Missing second segment of read files");
+
+	if (opt->sort_umi && opt->partition_bc)
+		__OPT_ERROR("--sort-umi and --partition-bc can not be used together");
+
+	if (opt->mem_limit && opt->partition_bc)
+		__OPT_ERROR("--mem-limit and --partition-bc can not be used together");
 }
 
 static void opt_check_num(int argc, char **argv)
@@ -192,6 +233,22 @@ struct opt_index_t *get_opt_index(int argc, char *argv[])
 		} else if (!strcmp(argv[pos], "--no-bwt")) {
 			opt->bwt = 0;
 			++pos;
+		} else if (!strcmp(argv[pos], "--dual-strand")) {
+			opt->dual_strand = 1;
+			++pos;
+		} else if (!strcmp(argv[pos], "--sa-intv")) {
+			opt_check_num(argc - pos, argv + pos);
+			opt->sa_intv = atoi(argv[pos + 1]);
+			if (!opt->sa_intv)
+				__OPT_ERROR("Invalid suffix array sampling interval: 0");
+			pos += 2;
+		} else if (!strcmp(argv[pos], "--kmer-lut")) {
+			opt_check_num(argc - pos, argv + pos);
+			opt->lut_k = atoi(argv[pos + 1]);
+			pos += 2;
+		} else if (!strcmp(argv[pos], "--genome-amb")) {
+			opt->genome_amb = 1;
+			++pos;
 		} else if (!strcmp(argv[pos], "-h")) {
 			print_index_usage();
 		} else {
@@ -272,6 +329,33 @@ struct opt_count_t *get_opt_count(int argc, char *argv[])
 		} else if (!strcmp(argv[pos], "--dump-align")) {
 			opt->is_dump_align = 1;
 			++pos;
+		} else if (!strcmp(argv[pos], "--sort-umi")) {
+			opt->sort_umi = 1;
+			++pos;
+		} else if (!strcmp(argv[pos], "--partition-bc")) {
+			opt->partition_bc = 1;
+			++pos;
+		} else if (!strcmp(argv[pos], "--two-pass")) {
+			opt->two_pass = 1;
+			++pos;
+		} else if (!strcmp(argv[pos], "--gzip")) {
+			opt->gzip_out = 1;
+			++pos;
+		} else if (!strcmp(argv[pos], "--csc")) {
+			opt->csc_out = 1;
+			++pos;
+		} else if (!strcmp(argv[pos], "--raw")) {
+			opt->raw_out = 1;
+			++pos;
+		} else if (!strcmp(argv[pos], "--mem-limit")) {
+			opt_check_num(argc - pos, argv + pos);
+			opt->mem_limit = (size_t)atoi(argv[pos + 1]) * SIZE_1MB;
+			if (!opt->mem_limit)
+				__OPT_ERROR("Invalid data for option %s: %s", argv[pos], argv[pos + 1]);
+			pos += 2;
+		} else if (!strcmp(argv[pos], "--pin-threads")) {
+			opt->pin_threads = 1;
+			++pos;
 		}  else if (!strcmp(argv[pos], "--count-intron")) {
 			opt->count_intron = 1;
 			++pos;
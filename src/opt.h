@@ -1,6 +1,8 @@
 #ifndef _OPT_H_
 #define _OPT_H_
 
+#include <stddef.h>
+
 #include "library_type.h"
 
 struct opt_index_t {
@@ -10,6 +12,10 @@ struct opt_index_t {
 	char *idx_dir;
 	int k;
 	int bwt;
+	int dual_strand;
+	int sa_intv;
+	int lut_k;
+	int genome_amb;
 };
 
 struct opt_count_t {
@@ -23,6 +29,14 @@ struct opt_count_t {
 	char *temp_dir;
 	int is_dump_align;
 	int count_intron;
+	int sort_umi;
+	int partition_bc;
+	int two_pass;
+	int gzip_out;
+	int csc_out;
+	int raw_out;
+	size_t mem_limit;	// bytes of UMIs kept in memory, 0 for no limit
+	int pin_threads;
 	char *log_file;
 	// Library type
 	struct library_t lib;
@@ -17,8 +17,13 @@
 #include "io_utils.h"
 #include "opt.h"
 #include "pthread_barrier.h"
+#include "thread_pool.h"
 #include "verbose.h"
 
+/* about 20 compressed or 70 plain read 1 records per bucket */
+#define BC_TABLE_BYTES_PER_BUCKET	2048
+#define BC_TABLE_MAX_PRESIZE		UINT32_C(0x1000000)
+
 static struct genome_info_t genome;
 static struct gene_info_t genes;
 static struct transcript_info_t trans;
@@ -35,6 +40,10 @@ void *align_worker(void *data);
 
 void *pair_producer_worker(void *data);
 
+void *r1_producer_worker(void *data);
+
+void *r1_count_worker(void *data);
+
 void update_result(struct align_stat_t *res, struct align_stat_t *add);
 
 void debug_index()
@@ -99,65 +108,141 @@ void check_some_statistics(struct kmhash_t *h)
 	__VERBOSE("Mean UMI per barcode                  : %.6f\n", s * 1.0 / h->n_items);
 }
 
-void single_cell_process(struct opt_count_t *opt)
+/* Readers of the input files and the queue they fill for the workers */
+struct producer_set_t {
+	struct dqueue_t *q;
+	struct producer_bundle_t *bundles;
+	void *streams;
+	pthread_mutex_t lock;
+	pthread_barrier_t barrier;
+	int n_consumer;
+	int n_producer;
+};
+
+/* Start the readers of both reads, or of read 1 only if right_file is NULL */
+static void start_producers(struct producer_set_t *ps, struct opt_count_t *opt,
+			    char **right_file, struct pool_group_t *group)
 {
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	int i;
 
-	struct align_stat_t result;
-	memset(&result, 0, sizeof(struct align_stat_t));
+	ps->q = init_dqueue_PE(opt->n_threads * 2); // must always >= n_thread * 2 in order to avoid deadlock
+	ps->n_consumer = opt->n_threads * 2;
+	ps->n_producer = __min(opt->n_files, opt->n_threads);
+	ps->bundles = malloc(ps->n_producer * sizeof(struct producer_bundle_t));
+	pthread_mutex_init(&ps->lock, NULL);
+	pthread_barrier_init(&ps->barrier, NULL, ps->n_producer);
+	if (right_file)
+		ps->streams = calloc(opt->n_files, sizeof(struct gb_pair_data));
+	else
+		ps->streams = calloc(opt->n_files, sizeof(struct gb_single_data));
+
+	for (i = 0; i < ps->n_producer; ++i) {
+		ps->bundles[i].streams = ps->streams;
+		ps->bundles[i].n_producer = ps->n_producer;
+		ps->bundles[i].thread_no = i;
+		ps->bundles[i].n_files = opt->n_files;
+		ps->bundles[i].left_file = opt->left_file;
+		ps->bundles[i].right_file = right_file;
+		ps->bundles[i].n_consumer = &ps->n_consumer;
+		ps->bundles[i].q = ps->q;
+		ps->bundles[i].barrier = &ps->barrier;
+		ps->bundles[i].lock = &ps->lock;
+	}
 
-	struct dqueue_t *q;
-	q = init_dqueue_PE(opt->n_threads * 2); // must always >= n_thread * 2 in order to avoid deadlock
-	int n_consumer, n_producer;
-	n_consumer = opt->n_threads * 2;
+	group->n_left = 0;
+	thread_pool_start(group, right_file ? pair_producer_worker :
+			  r1_producer_worker, ps->bundles,
+			  sizeof(struct producer_bundle_t), ps->n_producer);
+}
+
+/* Once the pool group of the readers and their consumers is joined */
+static void destroy_producers(struct producer_set_t *ps)
+{
+	dqueue_destroy(ps->q);
+	pthread_mutex_destroy(&ps->lock);
+	pthread_barrier_destroy(&ps->barrier);
+	free(ps->streams);
+	free(ps->bundles);
+}
 
-	struct producer_bundle_t *producer_bundles;
-	pthread_t *producer_threads;
+/* First pass of --two-pass: read count of every barcode from read 1 only */
+struct bc_count_t *count_barcode_r1(struct opt_count_t *opt)
+{
+	struct producer_set_t ps;
+	struct pool_group_t group;
+	int i;
 
-	n_producer = __min(opt->n_files, opt->n_threads);
-	// producer_bundles = malloc(opt->n_files * sizeof(struct producer_bundle_t));
-	// producer_threads = calloc(opt->n_files, sizeof(pthread_t));
-	producer_bundles = malloc(n_producer * sizeof(struct producer_bundle_t));
-	producer_threads = calloc(n_producer, sizeof(pthread_t));
+	start_producers(&ps, opt, NULL, &group);
 
-	pthread_mutex_t producer_lock;
-	pthread_barrier_t producer_barrier;
+	struct worker_bundle_t *worker_bundles;
+	worker_bundles = calloc(opt->n_threads, sizeof(struct worker_bundle_t));
 
-	pthread_mutex_init(&producer_lock, NULL);
-	pthread_barrier_init(&producer_barrier, NULL, n_producer);
+	for (i = 0; i < opt->n_threads; ++i) {
+		worker_bundles[i].q = ps.q;
+		worker_bundles[i].thread_no = i;
+		worker_bundles[i].lib = opt->lib;
+		worker_bundles[i].bc_count = init_bc_count(KMHASH_KMHASH_SIZE);
+	}
+	thread_pool_start(&group, r1_count_worker, worker_bundles,
+			  sizeof(struct worker_bundle_t), opt->n_threads);
+	thread_pool_join(&group);
+
+	struct bc_count_t *ret, *c;
+	kmint_t k;
+	ret = worker_bundles[0].bc_count;
+	for (i = 1; i < opt->n_threads; ++i) {
+		c = worker_bundles[i].bc_count;
+		for (k = 0; k < c->size; ++k)
+			if (c->keys[k] != TOMB_STONE)
+				bc_count_add(ret, c->keys[k], c->cnt[k]);
+		bc_count_destroy(c);
+	}
 
-	struct gb_pair_data *input_streams = calloc(opt->n_files,
-						sizeof(struct gb_pair_data));
+	destroy_producers(&ps);
+	free(worker_bundles);
 
-	int i;
-	for (i = 0; i < n_producer; ++i) {
-		// struct gb_pair_data *data = calloc(1, sizeof(struct gb_pair_data));
-		// gb_pair_init(data, opt->left_file[i], opt->right_file[i]);
-
-		producer_bundles[i].streams = input_streams;
-		producer_bundles[i].n_producer = n_producer;
-		producer_bundles[i].thread_no = i;
-		producer_bundles[i].n_files = opt->n_files;
-		producer_bundles[i].left_file = opt->left_file;
-		producer_bundles[i].right_file = opt->right_file;
-
-		producer_bundles[i].n_consumer = &n_consumer;
-		// producer_bundles[i].stream = (void *)data;
-		producer_bundles[i].q = q;
-		producer_bundles[i].barrier = &producer_barrier;
-		producer_bundles[i].lock = &producer_lock;
-		pthread_create(producer_threads + i, &attr,
-				pair_producer_worker, producer_bundles + i);
+	__VERBOSE("Number of barcodes in read 1: %u\n", ret->n_items);
+	return ret;
+}
+
+/*
+ * Buckets of the shared barcodes hash from the size of the read 1 files so
+ * that it seldom grows, growing is still needed for very diverse inputs
+ */
+static kmint_t estimate_bc_table_size(struct opt_count_t *opt)
+{
+	size_t n;
+	n = fetch_size(opt->left_file, opt->n_files) / BC_TABLE_BYTES_PER_BUCKET;
+	n = __max(n, KMHASH_KMHASH_SIZE);
+	return (kmint_t)__min(n, BC_TABLE_MAX_PRESIZE);
+}
+
+void single_cell_process(struct opt_count_t *opt)
+{
+	/* readers and aligners run together, the other phases reuse them */
+	thread_pool_init(opt->n_threads + __min(opt->n_files, opt->n_threads),
+			 opt->pin_threads);
+
+	struct align_stat_t result;
+	memset(&result, 0, sizeof(struct align_stat_t));
+
+	struct bc_count_t *bc_allow, *bc_count;
+	bc_allow = NULL;
+	if (opt->two_pass) {
+		bc_count = count_barcode_r1(opt);
+		bc_allow = select_barcodes(bc_count, opt->n_threads);
+		bc_count_destroy(bc_count);
 	}
 
+	struct producer_set_t ps;
+	struct pool_group_t group;
+	int i;
+
+	start_producers(&ps, opt, opt->right_file, &group);
+
 	struct worker_bundle_t *worker_bundles;
-	pthread_t *worker_threads;
 
 	worker_bundles = malloc(opt->n_threads * sizeof(struct worker_bundle_t));
-	worker_threads = calloc(opt->n_threads, sizeof(pthread_t));
 
 	pthread_mutex_t lock_count;
 	pthread_mutex_init(&lock_count, NULL);
@@ -172,39 +257,85 @@ void single_cell_process(struct opt_count_t *opt)
 	else
 		align_fstream = NULL;
 
-	struct kmhash_t *bc_table = init_kmhash(KMHASH_KMHASH_SIZE - 1, opt->n_threads);
+	/* Sort mode appends to thread-local buffers, the barcodes hash is
+	 * built once all reads are aligned */
+	struct kmhash_t *bc_table;
+	struct bc_buffer_t *bc_bufs;
+	struct bc_partition_t *bc_part;
+	struct bc_spill_t *bc_spill;
+	bc_table = NULL;
+	bc_bufs = NULL;
+	bc_part = NULL;
+	bc_spill = NULL;
+	if (opt->sort_umi || opt->mem_limit)
+		bc_bufs = calloc(opt->n_threads, sizeof(struct bc_buffer_t));
+	else if (opt->partition_bc)
+		bc_part = init_bc_partition(opt->n_threads);
+	else
+		bc_table = init_kmhash(estimate_bc_table_size(opt), opt->n_threads);
+
+	/* room for each buffer and its copy grouped by partition, the same for
+	 * the partitions loaded back and their copy */
+	if (opt->mem_limit) {
+		strcpy(path, opt->temp_dir); strcat(path, "/");
+		strcat(path, opt->prefix); strcat(path, ".umi.spill");
+		bc_spill = init_bc_spill(path, KMSORT_N_PARTITIONS, opt->n_threads,
+				opt->mem_limit / (2 * sizeof(struct bc_umi_t)));
+		for (i = 0; i < opt->n_threads; ++i) {
+			bc_bufs[i].m_max = opt->mem_limit / opt->n_threads /
+					   (2 * sizeof(struct bc_umi_t));
+			bc_bufs[i].spill = bc_spill;
+			bc_bufs[i].f = i;
+		}
+	}
 
 	for (i = 0; i < opt->n_threads; ++i) {
-		worker_bundles[i].q = q;
+		worker_bundles[i].q = ps.q;
 		worker_bundles[i].bc_table = bc_table;
+		worker_bundles[i].bc_buf = bc_bufs ? bc_bufs + i : NULL;
+		worker_bundles[i].bc_part = bc_part;
+		worker_bundles[i].bc_count = NULL;
+		worker_bundles[i].bc_allow = bc_allow;
+		worker_bundles[i].thread_no = i;
 		worker_bundles[i].lock_count = &lock_count;
-		worker_bundles[i].lock_hash = bc_table->locks + i;
+		worker_bundles[i].lock_hash = bc_table ? bc_table->locks + i : NULL;
 		worker_bundles[i].result = &result;
 		worker_bundles[i].lib = opt->lib;
 		if (opt->is_dump_align)
 			worker_bundles[i].align_fstream = align_fstream + i;
 		else
 			worker_bundles[i].align_fstream = NULL;
-		pthread_create(worker_threads + i, &attr, align_worker, worker_bundles + i);
 	}
-
-	for (i = 0; i < n_producer; ++i)
-		pthread_join(producer_threads[i], NULL);
-
-	for (i = 0; i < opt->n_threads; ++i)
-		pthread_join(worker_threads[i], NULL);
+	thread_pool_start(&group, align_worker, worker_bundles,
+			  sizeof(struct worker_bundle_t), opt->n_threads);
+	thread_pool_join(&group);
 
 	__VERBOSE("\rNumber of processed reads: %ld\n", result.nread);
 
 	destroy_shared_stream(align_fstream, opt->n_threads);
 	free_align_data();
-	dqueue_destroy(q);
+	destroy_producers(&ps);
 
 	// FIXME: Free align data
 
+	if (bc_table)
+		kmhash_finish_resize(bc_table);
+	if (opt->mem_limit) {
+		bc_table = kmhash_build_spill(bc_bufs, bc_spill, opt->n_threads);
+		free(bc_bufs);
+	} else if (opt->sort_umi) {
+		bc_table = kmhash_build_sorted(bc_bufs, opt->n_threads);
+		free(bc_bufs);
+	} else if (opt->partition_bc) {
+		bc_table = kmhash_build_partition(bc_part);
+	}
+	bc_count_destroy(bc_allow);
+
 	// check_some_statistics(bc_table);
 
-	quantification(opt, bc_table);
+	quantification(opt, bc_table, bc_spill);
+	bc_spill_destroy(bc_spill);
+	thread_pool_destroy();
 
 	// quantification(opt->out_dir, opt->n_threads);
 
@@ -274,10 +405,34 @@ void *align_worker(void *data)
 		memset(&own_result, 0, sizeof(struct align_stat_t));
 	}
 
+	if (bundle->bc_part)
+		bc_partition_finish(bundle->bc_part, bundle->thread_no);
+
 	destroy_bundle(bundle);
 	free_pair_buffer(own_buf);
 
-	pthread_exit(NULL);
+	return NULL;
+}
+
+/* Once every reader is done, each consumer is sent a NULL buffer */
+static void release_consumers(struct producer_bundle_t *bundle)
+{
+	struct pair_buffer_t *external_buf;
+	int cur;
+
+	pthread_barrier_wait(bundle->barrier);
+	while (1) {
+		pthread_mutex_lock(bundle->lock);
+		cur = *(bundle->n_consumer);
+		if (*(bundle->n_consumer) > 0)
+			--*(bundle->n_consumer);
+		pthread_mutex_unlock(bundle->lock);
+		if (cur == 0)
+			break;
+		external_buf = d_dequeue_out(bundle->q);
+		free_pair_buffer(external_buf);
+		d_enqueue_in(bundle->q, NULL);
+	}
 }
 
 void *pair_producer_worker(void *data)
@@ -307,22 +462,70 @@ void *pair_producer_worker(void *data)
 		}
 	}
 	free_pair_buffer(own_buf);
+	release_consumers(bundle);
+
+	return NULL;
+}
+
+void *r1_producer_worker(void *data)
+{
+	struct producer_bundle_t *bundle = (struct producer_bundle_t *)data;
+	struct dqueue_t *q = bundle->q;
+	struct pair_buffer_t *own_buf = init_pair_buffer();
+	struct pair_buffer_t *external_buf;
+	struct gb_single_data *streams, *stream;
+	streams = (struct gb_single_data *)bundle->streams;
+	int i;
+	for (i = bundle->thread_no; i < bundle->n_files; i += bundle->n_producer) {
+		stream = streams + i;
+		gb_single_init(stream, bundle->left_file[i]);
+		while (gb_get_single(stream, &own_buf->buf1) != -1) {
+			own_buf->input_format = stream->type;
+			external_buf = d_dequeue_out(q);
+			d_enqueue_in(q, own_buf);
+			own_buf = external_buf;
+		}
+		gb_single_destroy(stream);
+	}
+	free_pair_buffer(own_buf);
+	release_consumers(bundle);
+
+	return NULL;
+}
+
+void *r1_count_worker(void *data)
+{
+	struct worker_bundle_t *bundle = (struct worker_bundle_t *)data;
+	struct dqueue_t *q = bundle->q;
+	struct read_t read;
+	struct pair_buffer_t *own_buf, *ext_buf;
+	own_buf = init_pair_buffer();
+	int pos, rc;
+	uint64_t idx;
 
-	pthread_barrier_wait(bundle->barrier);
 	while (1) {
-		pthread_mutex_lock(bundle->lock);
-		int cur = *(bundle->n_consumer);
-		if (*(bundle->n_consumer) > 0)
-			--*(bundle->n_consumer);
-		pthread_mutex_unlock(bundle->lock);
-		if (cur == 0)
+		ext_buf = d_dequeue_in(q);
+		if (!ext_buf)
 			break;
-		external_buf = d_dequeue_out(q);
-		free_pair_buffer(external_buf);
-		d_enqueue_in(q, NULL);
+		d_enqueue_out(q, own_buf);
+		own_buf = ext_buf;
+		pos = 0;
+		while (1) {
+			rc = ext_buf->input_format == TYPE_FASTQ ?
+				get_read_from_fq(&read, ext_buf->buf1, &pos) :
+				get_read_from_fa(&read, ext_buf->buf1, &pos);
+			if (rc == READ_FAIL)
+				__ERROR("\nWrong format file\n");
+			if (read.seq && read.len >= bundle->lib.bc_len &&
+			    (idx = barcode2num(read.seq, bundle->lib.bc_len)) != TOMB_STONE)
+				bc_count_add(bundle->bc_count, idx, 1);
+			if (rc == READ_END)
+				break;
+		}
 	}
+	free_pair_buffer(own_buf);
 
-	pthread_exit(NULL);
+	return NULL;
 }
 
 // void *producer_worker(void *data)
@@ -373,10 +576,15 @@ void update_result(struct align_stat_t *res, struct align_stat_t *add)
 	}
 }
 
-void init_bwt(const char *path, int32_t count_intron)
+void init_bwt(const char *prefix, int32_t count_intron)
 {
 	extern struct bwt_t bwt;
-	bwt_load(path, &bwt);
+	char tmp_dir[1024];
+	strcpy(tmp_dir, prefix); strcat(tmp_dir, ".bwt");
+	bwt_load(tmp_dir, &bwt);
+	strcpy(tmp_dir, prefix); strcat(tmp_dir, ".lut");
+	if (bwt_load_lut(tmp_dir, &bwt))
+		__VERBOSE("Using %d-mer lookup table\n", bwt.lut_k);
 	genome_init_bwt(&bwt, count_intron);
 }
 
@@ -437,14 +645,16 @@ void init_ref_info(const char *path)
 void load_index(const char *prefix, int32_t count_intron)
 {
 	char tmp_dir[1024];
-	strcpy(tmp_dir, prefix); strcat(tmp_dir, ".bwt"); 
 	__VERBOSE("Loading BWT...\n");
-	init_bwt(tmp_dir, count_intron);
+	init_bwt(prefix, count_intron);
 
 	strcpy(tmp_dir, prefix); strcat(tmp_dir, ".info");
 	__VERBOSE("Loading transcripts and genes info...\n");
 	init_ref_info(tmp_dir);
 
+	strcpy(tmp_dir, prefix); strcat(tmp_dir, ".amb");
+	genome_init_amb(tmp_dir);
+
 	strcpy(tmp_dir, prefix); strcat(tmp_dir, ".hash");
 	__VERBOSE("Loading kmer hash table...\n");
 	alignment_init_hash(tmp_dir);
@@ -0,0 +1,156 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_pool.h"
+#include "utils.h"
+#include "verbose.h"
+
+static struct thread_pool_t pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.has_task = PTHREAD_COND_INITIALIZER,
+	.task_done = PTHREAD_COND_INITIALIZER,
+};
+
+static void pin_thread(pthread_t t, int i)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	long n_cpus;
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cpus <= 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(i % n_cpus, &set);
+	pthread_setaffinity_np(t, sizeof(cpu_set_t), &set);
+#else
+	(void)t;
+	(void)i;
+#endif
+}
+
+static void *pool_worker(void *data)
+{
+	struct pool_task_t task;
+	(void)data;
+
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (!pool.stop && pool.head == pool.n_tasks)
+			pthread_cond_wait(&pool.has_task, &pool.lock);
+		if (pool.head == pool.n_tasks)
+			break;
+		task = pool.tasks[pool.head++];
+		--pool.n_idle;
+		pthread_mutex_unlock(&pool.lock);
+
+		task.func(task.data);
+
+		pthread_mutex_lock(&pool.lock);
+		++pool.n_idle;
+		if (!--*task.n_left)
+			pthread_cond_broadcast(&pool.task_done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+/* The pool lock is held */
+static void pool_spawn(int n)
+{
+	pthread_attr_t attr;
+	int i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+	pool.threads = realloc(pool.threads, (pool.n_threads + n) * sizeof(pthread_t));
+	for (i = 0; i < n; ++i) {
+		if (pthread_create(pool.threads + pool.n_threads, &attr, pool_worker, NULL))
+			__ERROR("Could not create thread number %d", pool.n_threads);
+		if (pool.pin)
+			pin_thread(pool.threads[pool.n_threads], pool.n_threads);
+		++pool.n_threads;
+		++pool.n_idle;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+void thread_pool_init(int n_threads, int pin)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.pin = pin;
+	if (pool.n_threads < n_threads)
+		pool_spawn(n_threads - pool.n_threads);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void thread_pool_start(struct pool_group_t *g, void *(*func)(void *),
+		       void *bundles, size_t size, int n)
+{
+	struct pool_task_t *t;
+	int i, n_queued;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.head == pool.n_tasks)
+		pool.head = pool.n_tasks = 0;
+	if (pool.n_tasks + n > pool.m_tasks) {
+		pool.m_tasks = (pool.n_tasks + n) << 1;
+		pool.tasks = realloc(pool.tasks, pool.m_tasks * sizeof(struct pool_task_t));
+	}
+	for (i = 0; i < n; ++i) {
+		t = pool.tasks + pool.n_tasks++;
+		t->func = func;
+		t->data = (char *)bundles + i * size;
+		t->n_left = &g->n_left;
+	}
+	g->n_left += n;
+
+	/* every queued task must have an idle thread to take it */
+	n_queued = pool.n_tasks - pool.head;
+	if (n_queued > pool.n_idle)
+		pool_spawn(n_queued - pool.n_idle);
+	pthread_cond_broadcast(&pool.has_task);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void thread_pool_join(struct pool_group_t *g)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (g->n_left)
+		pthread_cond_wait(&pool.task_done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void thread_pool_run(void *(*func)(void *), void *bundles, size_t size, int n)
+{
+	struct pool_group_t g;
+	g.n_left = 0;
+	thread_pool_start(&g, func, bundles, size, n);
+	thread_pool_join(&g);
+}
+
+void thread_pool_destroy()
+{
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.has_task);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.n_threads; ++i)
+		pthread_join(pool.threads[i], NULL);
+
+	free(pool.threads);
+	free(pool.tasks);
+	pool.threads = NULL;
+	pool.tasks = NULL;
+	pool.n_threads = pool.n_idle = 0;
+	pool.head = pool.n_tasks = pool.m_tasks = 0;
+	pool.stop = 0;
+}
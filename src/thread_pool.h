@@ -0,0 +1,55 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <stddef.h>
+#define HAVE_STRUCT_TIMESPEC
+#include <pthread.h>
+
+/*
+ * Threads of the whole run, shared by every phase. Each task gets a thread
+ * of its own, as tasks of a phase wait on each other through queues and
+ * barriers, the pool grows when all its threads are busy
+ */
+struct pool_task_t {
+	void *(*func)(void *);
+	void *data;
+	int *n_left;			// of the group the task is part of
+};
+
+struct thread_pool_t {
+	pthread_mutex_t lock;
+	pthread_cond_t has_task;
+	pthread_cond_t task_done;
+	pthread_t *threads;
+	int n_threads;
+	int n_idle;			// threads waiting for a task
+	struct pool_task_t *tasks;
+	int head;
+	int n_tasks;
+	int m_tasks;
+	int pin;			// bind thread i to cpu i
+	int stop;
+};
+
+/* Tasks waited for together, n_left is 0 when all have returned */
+struct pool_group_t {
+	int n_left;
+};
+
+/* Start n_threads threads, optionally pinned to cores. Without it the pool
+ * is started with the first task */
+void thread_pool_init(int n_threads, int pin);
+
+/* func(bundles + i * size) for i in [0, n), each on its own thread. With
+ * size 0 all tasks share the same bundle */
+void thread_pool_start(struct pool_group_t *g, void *(*func)(void *),
+		       void *bundles, size_t size, int n);
+
+void thread_pool_join(struct pool_group_t *g);
+
+/* Start then join */
+void thread_pool_run(void *(*func)(void *), void *bundles, size_t size, int n);
+
+void thread_pool_destroy();
+
+#endif /* _THREAD_POOL_H_ */
@@ -49,35 +49,62 @@ char *get_rev(const char *seq, int len)
 	return ret;
 }
 
+void fill_rev_complement(char *ret, const char *seq, int len)
+{
+	int i, k;
+	for (i = 0, k = len - 1; i < len; ++i, --k)
+		ret[i] = rev_nt4_char[nt4_table[(int)seq[k]]];
+	ret[len] = '\0';
+}
+
 char *get_rev_complement(const char *seq, int len)
 {
 	if (seq == NULL)
 		return NULL;
 
 	char *ret = malloc(len + 1);
-	int i, k;
-	for (i = 0, k = len - 1; i < len; ++i, --k)
-		ret[i] = rev_nt4_char[nt4_table[(int)seq[k]]];
-	ret[len] = '\0';
+	fill_rev_complement(ret, seq, len);
 	return ret;
 }
 
 int64_t seq2num(const char *seq, int len)
 {
-	int64_t ret = 0;
-	int i;
-	for (i = 0; i < len; ++i)
-		ret = ret * 5 + nt4_table[(int)seq[i]];
-	return ret;
+	uint64_t ret = 0;
+	int i, c;
+	for (i = 0; i < len; ++i) {
+		c = nt4_table[(int)seq[i]];
+		ret <<= 2;
+		if (c < NNU)
+			ret |= c;
+	}
+	return (int64_t)ret;
+}
+
+int seq_n_pos(const char *seq, int len)
+{
+	int i, pos;
+	pos = -1;
+	for (i = 0; i < len; ++i) {
+		if (nt4_table[(int)seq[i]] < NNU)
+			continue;
+		if (pos != -1)
+			return -2;
+		pos = len - i - 1;
+	}
+	return pos;
 }
 
 char *num2seq(int64_t num, int len)
 {
 	char *ret = malloc(len + 1);
-	int i;
+	uint64_t x = (uint64_t)num;
+	int i, n;
+	n = __enc_N_pos(x, len);
 	for (i = 0; i < len; ++i) {
-		ret[len - i - 1] = nt4_char[num % 5];
-		num /= 5;
+		if (i == n)
+			ret[len - i - 1] = nt4_char[NNU];
+		else
+			ret[len - i - 1] = nt4_char[x >> (i << 1) & 3];
 	}
 	ret[len] = '\0';
 	return ret;
@@ -99,6 +126,8 @@ struct seed_t *init_seed()
 	ret->n_hit = malloc(ret->m_seed * sizeof(int));
 	ret->offset = malloc(ret->m_seed * sizeof(int));
 	ret->hits = malloc(ret->m_seed * sizeof(int *));
+	ret->m_chain = 0x10;
+	ret->chains = malloc(ret->m_chain * sizeof(struct anchor_chain_t));
 	return ret;
 }
 
@@ -110,6 +139,7 @@ void destroy_seed(struct seed_t *p)
 	free(p->n_hit);
 	free(p->offset);
 	free(p->hits);
+	free(p->chains);
 	free(p);
 }
 
@@ -251,7 +281,7 @@ void reinit_recycle_bin(struct recycle_bin_t *p)
 void reinit_seed(struct seed_t *p)
 {
 	assert(p != NULL);
-	p->n = p->n_seed = 0;
+	p->n = p->n_seed = p->n_chain = 0;
 }
 
 void destroy_recycle_bin(struct recycle_bin_t *p)
@@ -261,6 +291,60 @@ void destroy_recycle_bin(struct recycle_bin_t *p)
 	free(p);
 }
 
+struct arena_t *init_arena(size_t size)
+{
+	struct arena_t *ret = calloc(1, sizeof(struct arena_t));
+	ret->m = __max(size, ARENA_INIT_SIZE);
+	ret->buf = malloc(ret->m);
+	ret->l = ARENA_ALIGN;
+	return ret;
+}
+
+void *arena_alloc(struct arena_t *a, size_t size)
+{
+	char *p;
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (a->l + size > a->m) {
+		*(void **)a->buf = a->full;
+		a->full = a->buf;
+		a->m = __max(a->m << 1, size + ARENA_ALIGN);
+		a->buf = malloc(a->m);
+		a->l = ARENA_ALIGN;
+	}
+	p = a->buf + a->l;
+	a->l += size;
+	a->used += size;
+	return p;
+}
+
+void arena_reset(struct arena_t *a)
+{
+	void *next;
+	if (a->full) {
+		while (a->full) {
+			next = *(void **)a->full;
+			free(a->full);
+			a->full = next;
+		}
+		if (a->m < a->used + ARENA_ALIGN) {
+			free(a->buf);
+			a->m = a->used + ARENA_ALIGN;
+			a->buf = malloc(a->m);
+		}
+	}
+	a->l = ARENA_ALIGN;
+	a->used = 0;
+}
+
+void destroy_arena(struct arena_t *a)
+{
+	if (!a)
+		return;
+	arena_reset(a);
+	free(a->buf);
+	free(a);
+}
+
 void init_bundle(struct worker_bundle_t *bundle)
 {
 	bundle->alg_array = init_raw_alg();
@@ -268,6 +352,7 @@ void init_bundle(struct worker_bundle_t *bundle)
 	bundle->tmp_array = init_array_2D(100, 100, 4);
 	bundle->recycle_bin = init_recycle_bin();
 	bundle->seed_cons = init_seed();
+	bundle->arena = init_arena(ARENA_INIT_SIZE);
 }
 
 void reinit_bundle(struct worker_bundle_t *bundle)
@@ -276,6 +361,7 @@ void reinit_bundle(struct worker_bundle_t *bundle)
 	reinit_intron_array(bundle->intron_array);
 	reinit_recycle_bin(bundle->recycle_bin);
 	reinit_seed(bundle->seed_cons);
+	arena_reset(bundle->arena);
 }
 
 void destroy_bundle(struct worker_bundle_t *bundle)
@@ -285,4 +371,5 @@ void destroy_bundle(struct worker_bundle_t *bundle)
 	destroy_array_2D(bundle->tmp_array);
 	destroy_recycle_bin(bundle->recycle_bin);
 	destroy_seed(bundle->seed_cons);
+	destroy_arena(bundle->arena);
 }
@@ -26,10 +26,13 @@
 #include <windows.h>
 #include "getopt.h"
 #include <BaseTsd.h>
+#define __thread_yield()	SwitchToThread()
 #else
+#include <sched.h>
 #include <unistd.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#define __thread_yield()	sched_yield()
 #endif /* _MSC_VER */
 
 #define MAX_INT32		2147483647
@@ -109,17 +112,39 @@
 /* reverse compelemnt */
 char *get_rev_complement(const char *seq, int len);
 
+/* reverse complement into ret, which has room for len + 1 chars */
+void fill_rev_complement(char *ret, const char *seq, int len);
+
 /* reverse string */
 char *get_rev(const char *seq, int len);
 
 /* return new char* concate s1 and s2 */
 char *str_concate(const char *s1, const char *s2);
 
-/* convert from [ACGTN]+ seq to number */
+/*
+ * convert from [ACGTN]+ seq to number: 2 bits per base (first base most
+ * significant, N as 0)
+ */
 int64_t seq2num(const char *seq, int len);
 
+/* position of the only N of seq counted from its last base, -1 if none,
+ * -2 if several */
+int seq_n_pos(const char *seq, int len);
+
 /* convert from number to [ACGTN]+ to number */
 char *num2seq(int64_t num, int len);
+
+/*
+ * Barcode keys keep the position of a single N, counted from the last base,
+ * plus one above the bases. Only barcodes up to ENC_N_SHIFT / 2 bases leave
+ * room for it
+ */
+#define ENC_N_SHIFT		58
+#define __enc_N_room(len) (((len) << 1) <= ENC_N_SHIFT)
+#define __enc_N(j) ((uint64_t)((j) + 1) << ENC_N_SHIFT)
+#define __enc_N_pos(x, len) (__enc_N_room(len) ?			       \
+			     (int)((uint64_t)(x) >> ENC_N_SHIFT) - 1 : -1)
+#define __enc_clear_N(x) ((uint64_t)(x) & ((UINT64_C(1) << ENC_N_SHIFT) - 1))
 /*
  * Global variable
  */
@@ -134,6 +159,22 @@ struct array_2D_t {
 	void **rows;
 };
 
+#define ARENA_ALIGN		16
+#define ARENA_INIT_SIZE		0x10000
+
+/*
+ * Bump allocator of per-read scratch, nothing is freed before arena_reset.
+ * Chunks added when it runs out are merged into one at reset, so that the
+ * next reads need no allocation
+ */
+struct arena_t {
+	char *buf;
+	size_t l;
+	size_t m;
+	size_t used;		// bytes given since the last reset
+	void *full;		// previous chunks, each starts with a link to the next
+};
+
 struct producer_bundle_t {
 	int n_producer;
 	int n_files;
@@ -151,6 +192,11 @@ struct producer_bundle_t {
 struct worker_bundle_t {
 	struct dqueue_t *q;
 	struct kmhash_t *bc_table;
+	struct bc_buffer_t *bc_buf;
+	struct bc_partition_t *bc_part;
+	struct bc_count_t *bc_count;	// read 1 counts, first pass
+	struct bc_count_t *bc_allow;	// barcodes to keep, second pass
+	int thread_no;
 	pthread_mutex_t *lock_count;
 	pthread_mutex_t *lock_hash;
 	struct align_stat_t *result;
@@ -159,6 +205,7 @@ struct worker_bundle_t {
 	struct recycle_bin_t *recycle_bin;
 	struct seed_t *seed_cons;
 	struct array_2D_t *tmp_array;
+	struct arena_t *arena;		// per-read scratch
 	// struct stream_t *unmap_st;
 	struct shared_fstream_t *align_fstream;
 	struct library_t lib;
@@ -178,6 +225,14 @@ void free_pair_buffer(struct pair_buffer_t *p);
 
 void **resize_array_2D(struct array_2D_t *p, int nrow, int ncol, int word);
 
+struct arena_t *init_arena(size_t size);
+
+void *arena_alloc(struct arena_t *a, size_t size);
+
+void arena_reset(struct arena_t *a);
+
+void destroy_arena(struct arena_t *a);
+
 void init_bundle(struct worker_bundle_t *bundle);
 
 void destroy_bundle(struct worker_bundle_t *bundle);
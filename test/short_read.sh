@@ -0,0 +1,55 @@
+#!/bin/sh
+# Read 2 exactly as long as the consensus seed, which gets two seeds at the
+# same offset. Every read comes off a single exon and must be mapped there
+# usage: short_read.sh <hera-T binary>
+
+set -e
+
+BIN=${1:-./hera-T}
+K=29
+N=20
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v seed=1 'BEGIN {
+	srand(seed);
+	split("A C G T", b, " ");
+	s = "";
+	for (i = 0; i < 20000; ++i)
+		s = s b[int(rand() * 4) + 1];
+	print ">chr1";
+	for (i = 1; i <= length(s); i += 60)
+		print substr(s, i, 60);
+}' > "$DIR/genome.fa"
+
+printf 'chr1\tt\tgene\t5001\t6000\t.\t+\t.\tgene_id "G1"; gene_name "NG1";\n' > "$DIR/genes.gtf"
+printf 'chr1\tt\ttranscript\t5001\t6000\t.\t+\t.\tgene_id "G1"; transcript_id "G1.T1";\n' >> "$DIR/genes.gtf"
+printf 'chr1\tt\texon\t5001\t6000\t.\t+\t.\tgene_id "G1"; transcript_id "G1.T1";\n' >> "$DIR/genes.gtf"
+
+grep -v '^>' "$DIR/genome.fa" | tr -d '\n' | awk -v k=$K -v n=$N '{
+	split("A C G T", b, " ");
+	for (i = 0; i < n; ++i) {
+		umi = "";
+		x = i;
+		for (j = 0; j < 10; ++j) {
+			umi = umi b[x % 4 + 1];
+			x = int(x / 4);
+		}
+		q1 = q2 = "";
+		for (j = 0; j < 26; ++j) q1 = q1 "I";
+		for (j = 0; j < k; ++j) q2 = q2 "I";
+		print "@r" i "\nACGTACGTACGTACGT" umi "\n+\n" q1 > "'"$DIR"'/r1.fq";
+		print "@r" i "\n" substr($0, 5001 + i * 40, k) "\n+\n" q2 > "'"$DIR"'/r2.fq";
+	}
+}'
+
+"$BIN" index -g "$DIR/genome.fa" -t "$DIR/genes.gtf" -p ref -o "$DIR/idx" -k $K > "$DIR/index.log" 2>&1
+"$BIN" count -t 2 -x "$DIR/idx/ref" -o "$DIR/out" --log "$DIR/herat.log" -l 0 \
+	-1 "$DIR/r1.fq" -2 "$DIR/r2.fq" > "$DIR/count.log" 2>&1
+
+if ! grep -q "Number of exonic mapped reads *: *$N\$" "$DIR/count.log"; then
+	cat "$DIR/count.log"
+	echo "short_read: FAILED"
+	exit 1
+fi
+echo "short_read: OK"